@@ -2,74 +2,362 @@
 #define __array3d_sycl_hpp
 
 #include <CL/sycl.hpp>
+#include <cstdint>
 #include <vector>
 #include <memory>
 
 namespace sycl = cl::sycl;
 
+// -------------------------------------------------------------------------
+
+/// packed three component voxel types; unlike sycl::vec<T, 3> they are not
+/// padded to four components
+struct voxel_float3 {
+  float x, y, z;
+};
+
+struct voxel_half3 {
+  sycl::half x, y, z;
+};
+
+struct voxel_short3 {
+  short x, y, z;
+};
+
+// -------------------------------------------------------------------------
+
+/// conversion between float3 field values and the voxel storage type. The
+/// 16 bit integer storage maps [offset - scale, offset + scale] of every
+/// component linearly to the normalized range [-32767, 32767].
+template <typename T> struct voxel_codec;
+
+template <> struct voxel_codec<voxel_float3> {
+  static constexpr const char *name = "float";
+
+  static voxel_float3 encode(const sycl::float3 &v, const sycl::float3 &,
+                             const sycl::float3 &) {
+    return {v.x(), v.y(), v.z()};
+  }
+
+  static sycl::float3 decode(const voxel_float3 &v, const sycl::float3 &,
+                             const sycl::float3 &) {
+    return {v.x, v.y, v.z};
+  }
+};
+
+template <> struct voxel_codec<voxel_half3> {
+  static constexpr const char *name = "half";
+
+  static voxel_half3 encode(const sycl::float3 &v, const sycl::float3 &,
+                            const sycl::float3 &) {
+    return {sycl::half(v.x()), sycl::half(v.y()), sycl::half(v.z())};
+  }
+
+  static sycl::float3 decode(const voxel_half3 &v, const sycl::float3 &,
+                             const sycl::float3 &) {
+    return {float(v.x), float(v.y), float(v.z)};
+  }
+};
+
+template <> struct voxel_codec<voxel_short3> {
+  static constexpr const char *name = "int16";
+
+  static voxel_short3 encode(const sycl::float3 &v, const sycl::float3 &scale,
+                             const sycl::float3 &offset) {
+    auto quantize = [](float x, float s, float o) -> short {
+      const float n = s > 0.0f ? (x - o) / s : 0.0f;
+      return short(sycl::rint(32767.0f * sycl::clamp(n, -1.0f, 1.0f)));
+    };
+
+    return {quantize(v.x(), scale.x(), offset.x()),
+            quantize(v.y(), scale.y(), offset.y()),
+            quantize(v.z(), scale.z(), offset.z())};
+  }
+
+  static sycl::float3 decode(const voxel_short3 &v, const sycl::float3 &scale,
+                             const sycl::float3 &offset) {
+    const sycl::float3 n = {float(v.x), float(v.y), float(v.z)};
+    return offset + scale * (1.0f / 32767.0f) * n;
+  }
+};
+
+// -------------------------------------------------------------------------
+
+/// memory layout of the voxels: x fastest, then y, then z, or in bricks of
+/// 8x8x8 voxels that are laid out in the same order, so that the eight
+/// corners of a cell mostly fall into one brick
+enum class array_layout { linear, bricked };
+
+// -------------------------------------------------------------------------
+
+/// the decoded corner voxels of the cell a particle sampled last. Small
+/// steps mostly stay in one cell, so all stages of a step and often several
+/// steps can reuse the eight corners instead of gathering them again.
+struct cell_cache {
+  int i = -1, j = -1, k = -1;  // the cached cell, -1 if none
+  sycl::float3 corner[8];      // corner (dx, dy, dz) at dx + 2 dy + 4 dz
+  unsigned int hits = 0;       // samples served from the cache
+  unsigned int misses = 0;     // samples that loaded a cell
+};
+
+// -------------------------------------------------------------------------
+
+/// 3D grid of voxels of type T, interpolated as float3 values, with one
+/// validity bit per cell: a cell is valid if all its eight corner voxels are.
 template<typename T>
 class array3D {
 public:
   array3D() : m_nx(0), m_ny(0), m_nz(0) {}
 
-  void resize(sycl::queue &q, int nx, int ny, int nz) {
+  void resize(sycl::queue &q, int nx, int ny, int nz,
+              array_layout layout = array_layout::linear) {
     m_nx = nx;
     m_ny = ny;
     m_nz = nz;
-    size_t total = nx * ny * nz;
-    m_data = sycl::malloc_device<T>(total, q);
+    m_bricked = layout == array_layout::bricked;
+    m_bx = (nx + brick_size - 1) / brick_size;
+    m_by = (ny + brick_size - 1) / brick_size;
+    m_data = sycl::malloc_device<T>(size(), q);
+    m_mask = sycl::malloc_device<uint32_t>(mask_size(), q);
   }
 
+  /// copy nx*ny*nz voxels, given x fastest, rearranged into the layout
   void copy_to_device(sycl::queue &q, const std::vector<T> &host_data) {
-    q.memcpy(m_data, host_data.data(), host_data.size() * sizeof(T)).wait();
+    if (!m_bricked) {
+      q.memcpy(m_data, host_data.data(), host_data.size() * sizeof(T)).wait();
+      return;
+    }
+
+    std::vector<T> bricked(size());
+    for (int k = 0; k < m_nz; ++k)
+      for (int j = 0; j < m_ny; ++j)
+        for (int i = 0; i < m_nx; ++i)
+          bricked[index(i, j, k)] =
+              host_data[(size_t(k) * m_ny + j) * m_nx + i];
+
+    q.memcpy(m_data, bricked.data(), bricked.size() * sizeof(T)).wait();
+  }
+
+  /// number of voxels along x, y and z
+  sycl::int3 dims() const { return {m_nx, m_ny, m_nz}; }
+
+  /// number of stored voxels, including the padding of partial bricks
+  size_t size() const {
+    if (!m_bricked)
+      return size_t(m_nx) * m_ny * m_nz;
+
+    const size_t bz = (m_nz + brick_size - 1) / brick_size;
+    return size_t(m_bx) * m_by * bz * brick_size * brick_size * brick_size;
   }
 
-  sycl::float4 get(const sycl::global_ptr<const sycl::float4> &data,
+  /// position of voxel (i, j, k) in memory
+  size_t index(int i, int j, int k) const {
+    if (!m_bricked)
+      return (size_t(k) * m_ny + j) * m_nx + i;
+
+    const size_t brick =
+        (size_t(k >> brick_shift) * m_by + (j >> brick_shift)) * m_bx +
+        (i >> brick_shift);
+    const int mask = brick_size - 1;
+
+    return (brick << (3 * brick_shift)) |
+           (((k & mask) << (2 * brick_shift)) | ((j & mask) << brick_shift) |
+            (i & mask));
+  }
+
+  /// number of 32 bit words of the cell mask
+  size_t mask_size() const {
+    return (num_cells() + 31) / 32;
+  }
+
+  size_t num_cells() const {
+    return size_t(sycl::max(m_nx - 1, 0)) * sycl::max(m_ny - 1, 0) *
+           sycl::max(m_nz - 1, 0);
+  }
+
+  /// build the cell mask from the validity of the voxels, given in the
+  /// order of the voxel data
+  std::vector<uint32_t> cell_mask(const std::vector<bool> &voxel_valid) const {
+    std::vector<uint32_t> mask(mask_size(), 0u);
+
+    auto voxel = [&](int i, int j, int k) {
+      return voxel_valid[(size_t(k) * m_ny + j) * m_nx + i];
+    };
+
+    size_t c = 0;
+    for (int k = 0; k + 1 < m_nz; ++k)
+      for (int j = 0; j + 1 < m_ny; ++j)
+        for (int i = 0; i + 1 < m_nx; ++i, ++c)
+          if (voxel(i, j, k) && voxel(i + 1, j, k) && voxel(i, j + 1, k) &&
+              voxel(i + 1, j + 1, k) && voxel(i, j, k + 1) &&
+              voxel(i + 1, j, k + 1) && voxel(i, j + 1, k + 1) &&
+              voxel(i + 1, j + 1, k + 1))
+            mask[c >> 5] |= 1u << (c & 31);
+
+    return mask;
+  }
+
+  void copy_mask_to_device(sycl::queue &q, const std::vector<uint32_t> &mask) {
+    q.memcpy(m_mask, mask.data(), mask.size() * sizeof(uint32_t)).wait();
+  }
+
+  /// value range of the quantized storage types, see voxel_codec
+  void set_range(const sycl::float3 &scale, const sycl::float3 &offset) {
+    m_scale = scale;
+    m_offset = offset;
+  }
+
+  sycl::float3 range_scale() const { return m_scale; }
+  sycl::float3 range_offset() const { return m_offset; }
+
+  T encode(const sycl::float3 &v) const {
+    return voxel_codec<T>::encode(v, m_scale, m_offset);
+  }
+
+  sycl::float3 decode(const T &v) const {
+    return voxel_codec<T>::decode(v, m_scale, m_offset);
+  }
+
+  /// true if (x, y, z) lies in a valid cell; points on the upper faces of
+  /// the grid belong to the last cell
+  bool valid(float x, float y, float z) const {
+    // also rejects NaN coordinates
+    if (!(x >= 0.0f && y >= 0.0f && z >= 0.0f && x <= m_nx - 1 &&
+          y <= m_ny - 1 && z <= m_nz - 1))
+      return false;
+
+    const int i = sycl::min(static_cast<int>(x), m_nx - 2);
+    const int j = sycl::min(static_cast<int>(y), m_ny - 2);
+    const int k = sycl::min(static_cast<int>(z), m_nz - 2);
+
+    const size_t c = (size_t(k) * (m_ny - 1) + j) * (m_nx - 1) + i;
+
+    return (m_mask[c >> 5] >> (c & 31)) & 1u;
+  }
+
+  /// trilinear interpolation at (x, y, z) in index space; corners outside
+  /// the grid contribute zero
+  sycl::float3 get(const sycl::global_ptr<const T> &data,
                    float x, float y, float z) const {
-    // use as index space
-    int x0 = static_cast<int>(sycl::floor(x));
-    int y0 = static_cast<int>(sycl::floor(y));
-    int z0 = static_cast<int>(sycl::floor(z));
-
-    float fx = x - x0;
-    float fy = y - y0;
-    float fz = z - z0;
-
-    sycl::float4 result = {0, 0, 0, 0};
-
-    for (int dz = 0; dz <= 1; ++dz) {
-      int zc = z0 + dz;
-      if (zc < 0 || zc >= m_nz) continue;
-      float wz = dz ? fz : 1.f - fz;
-
-      for (int dy = 0; dy <= 1; ++dy) {
-        int yc = y0 + dy;
-        if (yc < 0 || yc >= m_ny) continue;
-        float wy = dy ? fy : 1.f - fy;
-
-        for (int dx = 0; dx <= 1; ++dx) {
-          int xc = x0 + dx;
-          if (xc < 0 || xc >= m_nx) continue;
-          float wx = dx ? fx : 1.f - fx;
-
-          size_t idx = zc * m_ny * m_nx + yc * m_nx + xc;
-          sycl::float4 val = data[idx];
-          result += val * (wx * wy * wz);
-        }
-      }
+    const int x0 = static_cast<int>(sycl::floor(x));
+    const int y0 = static_cast<int>(sycl::floor(y));
+    const int z0 = static_cast<int>(sycl::floor(z));
+
+    const float fx = x - x0;
+    const float fy = y - y0;
+    const float fz = z - z0;
+
+    sycl::float3 v[8];
+
+    // a single test for the common case of a cell inside the grid, which
+    // needs neither clamping nor weighting of the corners
+    if ((x0 >= 0) & (y0 >= 0) & (z0 >= 0) & (x0 < m_nx - 1) &
+        (y0 < m_ny - 1) & (z0 < m_nz - 1)) {
+      load_corners(data, x0, x0 + 1, y0, y0 + 1, z0, z0 + 1, v);
+      return interpolate(v, fx, fy, fz);
+    }
+
+    // on the boundary the corner indices are clamped into the grid, and the
+    // corners that were moved are zeroed
+    auto clamped = [](int i, int n) { return sycl::clamp(i, 0, n - 1); };
+    auto inside = [](int i, int n) { return (i >= 0) & (i < n) ? 1.0f : 0.0f; };
+
+    load_corners(data, clamped(x0, m_nx), clamped(x0 + 1, m_nx),
+                 clamped(y0, m_ny), clamped(y0 + 1, m_ny), clamped(z0, m_nz),
+                 clamped(z0 + 1, m_nz), v);
+
+    const float ox[2] = {inside(x0, m_nx), inside(x0 + 1, m_nx)};
+    const float oy[2] = {inside(y0, m_ny), inside(y0 + 1, m_ny)};
+    const float oz[2] = {inside(z0, m_nz), inside(z0 + 1, m_nz)};
+
+    for (int d = 0; d < 8; ++d)
+      v[d] *= ox[d & 1] * oy[(d >> 1) & 1] * oz[(d >> 2) & 1];
+
+    return interpolate(v, fx, fy, fz);
+  }
+
+  /// like valid() and get() combined, with the corners of the last sampled
+  /// cell kept in cache: true and the interpolated value at (x, y, z) if it
+  /// lies in a valid cell. The cache must only be used with this array.
+  bool sample(float x, float y, float z, cell_cache &cache,
+              sycl::float3 &result) const {
+    // also rejects NaN coordinates
+    if (!(x >= 0.0f && y >= 0.0f && z >= 0.0f && x <= m_nx - 1 &&
+          y <= m_ny - 1 && z <= m_nz - 1))
+      return false;
+
+    const int i = sycl::min(static_cast<int>(x), m_nx - 2);
+    const int j = sycl::min(static_cast<int>(y), m_ny - 2);
+    const int k = sycl::min(static_cast<int>(z), m_nz - 2);
+
+    if (i == cache.i && j == cache.j && k == cache.k) {
+      // the cached cell passed the mask test when it was loaded
+      ++cache.hits;
+    } else {
+      const size_t c = (size_t(k) * (m_ny - 1) + j) * (m_nx - 1) + i;
+
+      if (!((m_mask[c >> 5] >> (c & 31)) & 1u))
+        return false;
+
+      load_corners(m_data, i, i + 1, j, j + 1, k, k + 1, cache.corner);
+
+      cache.i = i;
+      cache.j = j;
+      cache.k = k;
+      ++cache.misses;
     }
 
-    return result;
+    // points on the upper faces of the grid get a weight of one
+    result = interpolate(cache.corner, x - i, y - j, z - k);
+
+    return true;
+  }
+
+  /// trilinear interpolation of the corners v at the fractions (fx, fy, fz)
+  /// of the cell, as seven lerps
+  static sycl::float3 interpolate(const sycl::float3 *v, float fx, float fy,
+                                  float fz) {
+    const sycl::float3 v00 = v[0] + fx * (v[1] - v[0]);
+    const sycl::float3 v10 = v[2] + fx * (v[3] - v[2]);
+    const sycl::float3 v01 = v[4] + fx * (v[5] - v[4]);
+    const sycl::float3 v11 = v[6] + fx * (v[7] - v[6]);
+    const sycl::float3 v0 = v00 + fy * (v10 - v00);
+    const sycl::float3 v1 = v01 + fy * (v11 - v01);
+
+    return v0 + fz * (v1 - v0);
   }
 
   sycl::global_ptr<T> data() const { return m_data; }
+  sycl::global_ptr<uint32_t> mask() const { return m_mask; }
   int nx() const { return m_nx; }
   int ny() const { return m_ny; }
   int nz() const { return m_nz; }
 
 private:
+  /// decode the corners (i0 or i1, j0 or j1, k0 or k1) into v, in the
+  /// order of cell_cache::corner; the indices must lie inside the grid
+  void load_corners(const sycl::global_ptr<const T> &data, int i0, int i1,
+                    int j0, int j1, int k0, int k1, sycl::float3 *v) const {
+    v[0] = decode(data[index(i0, j0, k0)]);
+    v[1] = decode(data[index(i1, j0, k0)]);
+    v[2] = decode(data[index(i0, j1, k0)]);
+    v[3] = decode(data[index(i1, j1, k0)]);
+    v[4] = decode(data[index(i0, j0, k1)]);
+    v[5] = decode(data[index(i1, j0, k1)]);
+    v[6] = decode(data[index(i0, j1, k1)]);
+    v[7] = decode(data[index(i1, j1, k1)]);
+  }
+
+  static constexpr int brick_shift = 3;
+  static constexpr int brick_size = 1 << brick_shift;
+
   int m_nx, m_ny, m_nz;
+  bool m_bricked = false;
+  int m_bx = 0, m_by = 0; // number of bricks along x and y
   sycl::global_ptr<T> m_data;
+  sycl::global_ptr<uint32_t> m_mask;
+  sycl::float3 m_scale = {1.0f, 1.0f, 1.0f};
+  sycl::float3 m_offset = {0.0f, 0.0f, 0.0f};
 };
 
 #endif // __array3d_sycl_hpp
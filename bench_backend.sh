@@ -0,0 +1,17 @@
+#!/bin/bash
+# compare the SYCL kernels on the default device with the SIMD host backend,
+# on the same seeds, for every fixed step scheme
+# usage: BIN=./streamlines_man ./bench_backend.sh [seeds] [steps] [dt]
+BIN=${BIN:-./streamlines_man}
+SEEDS=${1:-10000}
+STEPS=${2:-1000}
+DT=${3:-0.002}
+
+for scheme in euler heun rk4; do
+  for backend in sycl simd; do
+    echo "scheme $scheme, backend $backend:"
+    $BIN --nseeds $SEEDS --nsteps $STEPS --dt $DT --scheme $scheme \
+         --backend $backend 2>&1 |
+      grep -E "^integrated"
+  done
+done
@@ -0,0 +1,17 @@
+#!/bin/bash
+# compare the linear and the bricked field layout on the same seeds, for
+# every field storage type
+# usage: BIN=./streamlines_man ./bench_layout.sh [seeds] [steps] [dt]
+BIN=${BIN:-./streamlines_man}
+SEEDS=${1:-10000}
+STEPS=${2:-1000}
+DT=${3:-0.002}
+
+for storage in float half int16; do
+  for layout in linear brick; do
+    echo "storage $storage, layout $layout:"
+    $BIN --nseeds $SEEDS --nsteps $STEPS --dt $DT --scheme rk4 \
+         --storage $storage --layout $layout 2>&1 |
+      grep -E "^(field storage|integrated)"
+  done
+done
@@ -0,0 +1,23 @@
+#!/bin/bash
+# strong and weak scaling of the slab-decomposed integration on one machine:
+# the same seeds on more ranks, and a fixed number of seeds per rank
+# usage: BIN=./streamlines_mpi ./bench_mpi.sh [seeds] [steps] [dt] [ranks...]
+BIN=${BIN:-./streamlines_mpi}
+MPIRUN=${MPIRUN:-mpirun}
+SEEDS=${1:-10000}
+STEPS=${2:-1000}
+DT=${3:-0.002}
+shift 3
+RANKS=${@:-1 2 4}
+
+echo "strong scaling, $SEEDS seeds:"
+for np in $RANKS; do
+  $MPIRUN -np $np $BIN --nseeds $SEEDS --nsteps $STEPS --dt $DT 2>&1 |
+    grep -E "^integrated"
+done
+
+echo "weak scaling, $SEEDS seeds per rank:"
+for np in $RANKS; do
+  $MPIRUN -np $np $BIN --nseeds $((SEEDS * np)) --nsteps $STEPS --dt $DT 2>&1 |
+    grep -E "^integrated"
+done
@@ -0,0 +1,18 @@
+#!/bin/bash
+# compare integration with and without periodic spatial re-sorting of the
+# particles, for both field layouts
+# usage: BIN=./streamlines_man ./bench_sort.sh [seeds] [steps] [dt] [interval]
+BIN=${BIN:-./streamlines_man}
+SEEDS=${1:-10000}
+STEPS=${2:-1000}
+DT=${3:-0.002}
+INTERVAL=${4:-64}
+
+for layout in linear brick; do
+  for sort in 0 $INTERVAL; do
+    echo "layout $layout, sort interval $sort:"
+    $BIN --nseeds $SEEDS --nsteps $STEPS --dt $DT --scheme rk4 \
+         --layout $layout --sort $sort 2>&1 |
+      grep -E "^integrated"
+  done
+done
@@ -0,0 +1,69 @@
+#ifndef __devices_sycl_hpp
+#define __devices_sycl_hpp
+
+#include <CL/sycl.hpp>
+#include <vector>
+
+namespace sycl = cl::sycl;
+
+// -------------------------------------------------------------------------
+
+/// the available devices, each listed once. A device is usually offered by
+/// several backends, e.g. a GPU by Level Zero and by OpenCL, so all devices
+/// of a type are taken from one backend: that of the default device if it
+/// offers the type, else that of the first device of the type.
+inline std::vector<sycl::device> unique_devices() {
+  const sycl::backend preferred =
+      sycl::device(sycl::default_selector_v).get_backend();
+  std::vector<sycl::device> devices;
+
+  for (const sycl::info::device_type type :
+       {sycl::info::device_type::gpu, sycl::info::device_type::cpu,
+        sycl::info::device_type::accelerator}) {
+    const std::vector<sycl::device> candidates =
+        sycl::device::get_devices(type);
+    if (candidates.empty())
+      continue;
+
+    sycl::backend backend = candidates.front().get_backend();
+    for (const sycl::device &device : candidates)
+      if (device.get_backend() == preferred)
+        backend = preferred;
+
+    for (const sycl::device &device : candidates)
+      if (device.get_backend() == backend)
+        devices.push_back(device);
+  }
+
+  return devices;
+}
+
+/// one out-of-order queue per available device. CPU devices are split into
+/// one sub-device per NUMA domain where the backend supports it, so that
+/// every domain works on its own copy of the field.
+inline std::vector<sycl::queue> device_queues() {
+  std::vector<sycl::queue> queues;
+
+  for (const sycl::device &device : unique_devices()) {
+    if (device.is_cpu()) {
+      try {
+        const std::vector<sycl::device> domains = device.create_sub_devices<
+            sycl::info::partition_property::partition_by_affinity_domain>(
+            sycl::info::partition_affinity_domain::numa);
+
+        for (const sycl::device &domain : domains)
+          queues.emplace_back(domain);
+
+        continue;
+      } catch (const sycl::exception &) {
+        // not partitionable, use the device as a whole
+      }
+    }
+
+    queues.emplace_back(device);
+  }
+
+  return queues;
+}
+
+#endif // __devices_sycl_hpp
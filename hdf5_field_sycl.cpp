@@ -1,7 +1,23 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstring>
+#include <exception>
+#include <iostream>
 #include <memory>
+#include <mutex>
 #include <stdexcept>
+#include <thread>
+#include <type_traits>
 #include <vector>
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 #include "hdf5.h"
 #include "hdf5_field_sycl.h"
 #include <sycl/sycl.hpp>
@@ -10,8 +26,330 @@
 
 // -------------------------------------------------------------------------
 
-hdf5_field::hdf5_field(sycl::queue &q, const std::string &filename)
+std::mutex hdf5_mutex;
+
+namespace {
+
+/// size of the slabs a field is streamed to the device in, and the number
+/// of threads reading them at most
+constexpr size_t slab_bytes = size_t(64) << 20;
+constexpr unsigned int max_readers = 4;
+
+/// reads ranges of a 4D float dataset, flattened in storage order. A
+/// contiguous dataset of native floats is read with pread(), so that
+/// several threads can read at once; any other dataset goes through
+/// H5Dread, one thread at a time, in whole rows of its first dimension.
+class float_reader {
+public:
+  float_reader(const std::string &filename, hid_t dset, const hsize_t *dims)
+      : m_dset(dset), m_dims{dims[0], dims[1], dims[2], dims[3]},
+        m_row(dims[1] * dims[2] * dims[3]) {
+    hid_t type = H5Dget_type(dset);
+    const bool native = H5Tequal(type, H5T_NATIVE_FLOAT) > 0;
+    H5Tclose(type);
+
+    // undefined unless the data is stored contiguously in the file
+    const haddr_t offset = H5Dget_offset(dset);
+
+    if (native && offset != HADDR_UNDEF) {
+      m_fd = open(filename.c_str(), O_RDONLY);
+      m_offset = offset;
+    }
+  }
+
+  ~float_reader() {
+    if (m_fd >= 0)
+      close(m_fd);
+  }
+
+  float_reader(const float_reader &) = delete;
+  float_reader &operator=(const float_reader &) = delete;
+
+  /// floats a buffer passed to read() needs beyond the range itself
+  size_t padding() const { return m_fd >= 0 ? 0 : 2 * m_row; }
+
+  /// read the floats [begin, end) into buffer; returns where they start
+  const float *read(size_t begin, size_t end, float *buffer) const {
+    if (m_fd >= 0) {
+      char *p = reinterpret_cast<char *>(buffer);
+      size_t bytes = (end - begin) * sizeof(float);
+      off_t at = m_offset + begin * sizeof(float);
+
+      while (bytes > 0) {
+        const ssize_t n = pread(m_fd, p, bytes, at);
+        if (n <= 0)
+          throw std::runtime_error("Failed to read HDF5 dataset");
+
+        p += n;
+        at += n;
+        bytes -= n;
+      }
+
+      return buffer;
+    }
+
+    // the rows covering the range
+    hsize_t start[4] = {begin / m_row, 0, 0, 0};
+    hsize_t count[4] = {(end + m_row - 1) / m_row - start[0], m_dims[1],
+                        m_dims[2], m_dims[3]};
+
+    std::lock_guard<std::mutex> lock(hdf5_mutex);
+
+    hid_t space = H5Dget_space(m_dset);
+    H5Sselect_hyperslab(space, H5S_SELECT_SET, start, nullptr, count, nullptr);
+    hid_t memspace = H5Screate_simple(4, count, nullptr);
+
+    const herr_t status = H5Dread(m_dset, H5T_NATIVE_FLOAT, memspace, space,
+                                  H5P_DEFAULT, buffer);
+
+    H5Sclose(memspace);
+    H5Sclose(space);
+
+    if (status < 0)
+      throw std::runtime_error("Failed to read HDF5 dataset");
+
+    return buffer + (begin - start[0] * m_row);
+  }
+
+private:
+  hid_t m_dset;
+  hsize_t m_dims[4];
+  size_t m_row; // floats per index of the first dimension
+  int m_fd = -1;
+  off_t m_offset = 0;
+};
+
+// -------------------------------------------------------------------------
+
+/// stream the floats [begin, end) of a dataset through the device in slabs
+/// of slab_floats floats, a multiple of 3. num_readers threads read the
+/// slabs into pinned host buffers; every slab is uploaded as soon as it has
+/// been read, and process(slab, first, count, upload) submits the kernels
+/// working on the device copy of its voxels [first, first + count), after
+/// the event upload, and returns their event. Slabs are read while earlier
+/// ones are uploaded and processed, and no host copy of the whole range is
+/// made.
+template <typename Process>
+void stream_slabs(sycl::queue &q, const float_reader &reader, size_t begin,
+                  size_t end, size_t slab_floats, unsigned int num_readers,
+                  Process process) {
+  const size_t num_slabs = (end - begin + slab_floats - 1) / slab_floats;
+  num_readers = std::max<size_t>(1, std::min<size_t>(num_readers, num_slabs));
+
+  // one buffer more than readers, so that every reader can read a slab
+  // while another one is uploaded
+  const unsigned int num_buffers = num_readers + 1;
+  const size_t buffer_floats = slab_floats + reader.padding();
+
+  std::vector<float *> host(num_buffers), device(num_buffers);
+  std::vector<sycl::event> processed(num_buffers);
+  for (unsigned int b = 0; b < num_buffers; ++b) {
+    host[b] = sycl::malloc_host<float>(buffer_floats, q);
+    device[b] = sycl::malloc_device<float>(slab_floats, q);
+  }
+
+  auto slab_begin = [&](size_t s) { return begin + s * slab_floats; };
+  auto slab_end = [&](size_t s) {
+    return std::min(begin + (s + 1) * slab_floats, end);
+  };
+
+  std::mutex mutex;
+  std::condition_variable changed;
+  std::vector<const float *> ready(num_slabs, nullptr);
+  size_t released = 0; // slabs whose host buffer can be reused
+  std::exception_ptr error;
+  std::atomic<size_t> next_slab(0);
+
+  auto read = [&]() {
+    for (;;) {
+      const size_t s = next_slab++;
+      if (s >= num_slabs)
+        return;
+
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        changed.wait(lock,
+                     [&]() { return error || s < released + num_buffers; });
+        if (error)
+          return;
+      }
+
+      const float *data = nullptr;
+      try {
+        data = reader.read(slab_begin(s), slab_end(s), host[s % num_buffers]);
+      } catch (...) {
+        std::lock_guard<std::mutex> lock(mutex);
+        error = std::current_exception();
+      }
+
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        ready[s] = data;
+      }
+      changed.notify_all();
+
+      if (!data)
+        return;
+    }
+  };
+
+  std::vector<std::thread> readers;
+  for (unsigned int n = 0; n < num_readers; ++n)
+    readers.emplace_back(read);
+
+  for (size_t s = 0; s < num_slabs; ++s) {
+    const float *data = nullptr;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      changed.wait(lock, [&]() { return error || ready[s]; });
+      if (error)
+        break;
+      data = ready[s];
+    }
+
+    const unsigned int b = s % num_buffers;
+    const size_t count = slab_end(s) - slab_begin(s);
+
+    // the device buffer is free once the slab before in it is processed
+    sycl::event upload =
+        q.memcpy(device[b], data, count * sizeof(float), processed[b]);
+    processed[b] = process(device[b], (slab_begin(s) - begin) / 3, count / 3,
+                           upload);
+
+    upload.wait();
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      released = s + 1;
+    }
+    changed.notify_all();
+  }
+
+  for (std::thread &thread : readers)
+    thread.join();
+
+  q.wait();
+
+  for (unsigned int b = 0; b < num_buffers; ++b) {
+    sycl::free(host[b], q);
+    sycl::free(device[b], q);
+  }
+
+  if (error)
+    std::rethrow_exception(error);
+}
+
+// -------------------------------------------------------------------------
+
+/// identity of the source of a field cache: FNV-1a over the size and the
+/// modification time of the file and 16 blocks of 4 KiB spread over it.
+/// Hashing all of a file of several GB would cost as much as loading it, so
+/// this is a fingerprint rather than a content hash: an edit outside the
+/// sampled blocks that keeps the modification time goes unnoticed, and the
+/// cache has to be refreshed by hand. Returns false if the file cannot be
+/// examined.
+bool source_hash(const std::string &filename, uint64_t &hash) {
+  hash = 14695981039346656037ull;
+
+  auto add = [&](const void *data, size_t size) {
+    const unsigned char *bytes = static_cast<const unsigned char *>(data);
+    for (size_t n = 0; n < size; ++n)
+      hash = (hash ^ bytes[n]) * 1099511628211ull;
+  };
+
+  const int fd = open(filename.c_str(), O_RDONLY);
+  if (fd < 0)
+    return false;
+
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    return false;
+  }
+
+  add(&st.st_size, sizeof(st.st_size));
+  add(&st.st_mtim, sizeof(st.st_mtim));
+
+  const size_t block = 4096;
+  const size_t num_blocks = 16;
+  std::vector<char> data(block);
+
+  for (size_t n = 0; n < num_blocks; ++n) {
+    const off_t at = (st.st_size - std::min<off_t>(block, st.st_size)) * n /
+                     (num_blocks - 1);
+    const ssize_t read = pread(fd, data.data(), block, at);
+    if (read > 0)
+      add(data.data(), read);
+  }
+
+  close(fd);
+
+  return true;
+}
+
+// -------------------------------------------------------------------------
+
+/// header of a field cache file. It is followed by the voxels in the layout
+/// of the array and by the cell mask, both at page aligned offsets, so that
+/// they are copied to the device straight from the mapped file.
+struct field_cache_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t voxel_size;
+  char codec[8];     // voxel_codec<Voxel>::name
+  uint32_t layout;   // array_layout
+  int32_t z_begin;   // the z planes as requested
+  int32_t z_end;
+  int32_t nx, ny, nz;
+  uint64_t source_hash;
+  float range_scale[3], range_offset[3];
+  float scale[3], offset[3];
+  uint64_t data_offset, data_bytes;
+  uint64_t mask_offset, mask_bytes;
+};
+
+const char field_cache_magic[8] = "SLFIELD";
+constexpr uint32_t field_cache_version = 1;
+constexpr size_t field_cache_alignment = 4096;
+
+size_t align_up(size_t n, size_t alignment) {
+  return (n + alignment - 1) / alignment * alignment;
+}
+
+} // namespace
+
+// -------------------------------------------------------------------------
+
+template <typename Voxel>
+hdf5_field<Voxel>::hdf5_field(sycl::queue &q, const std::string &filename,
+                              array_layout layout, int z_begin, int z_end,
+                              const std::string &cache)
     : m_array() {
+  if (cache.empty()) {
+    read(q, filename, layout, z_begin, z_end);
+    return;
+  }
+
+  // without the identity of the source a cache could be stale
+  uint64_t hash;
+  if (!source_hash(filename, hash)) {
+    std::cerr << "field cache disabled: cannot examine " << filename << "\n";
+    read(q, filename, layout, z_begin, z_end);
+    return;
+  }
+
+  if (load_cache(q, cache, hash, layout, z_begin, z_end))
+    return;
+
+  read(q, filename, layout, z_begin, z_end);
+  save_cache(q, cache, hash, layout, z_begin, z_end);
+}
+
+// -------------------------------------------------------------------------
+
+template <typename Voxel>
+void hdf5_field<Voxel>::read(sycl::queue &q, const std::string &filename,
+                             array_layout layout, int z_begin, int z_end) {
+  const auto start_time = std::chrono::steady_clock::now();
 
   hid_t file = H5Fopen(filename.c_str(), H5F_ACC_RDONLY, H5P_DEFAULT);
 
@@ -29,32 +367,176 @@ hdf5_field::hdf5_field(sycl::queue &q, const std::string &filename)
 
   hsize_t dims[4];
   H5Sget_simple_extent_dims(space, dims, nullptr);
+  H5Sclose(space);
   unsigned int ny = dims[0];
   unsigned int nx = dims[1];
   unsigned int nz = dims[2];
 
-  // Allocate and read data
-  std::vector<float> rawData(nx * ny * nz * 3);
-  H5Dread(dset, H5T_NATIVE_FLOAT, H5S_ALL, H5S_ALL, H5P_DEFAULT,
-          rawData.data());
+  // the z planes to load
+  if (z_end < 0 || z_end > int(nz))
+    z_end = nz;
+  z_begin = std::max(0, std::min(z_begin, z_end - 1));
+  nz = z_end - z_begin;
 
-  // Clean up
-  H5Sclose(space);
+  // The planes are a contiguous range of the dataset, which is streamed to
+  // the device in slabs of whole planes
+  const size_t plane = size_t(nx) * ny * 3;
+  const size_t begin = z_begin * plane;
+  const size_t end = z_end * plane;
+  const size_t slab_planes =
+      std::max<size_t>(1, slab_bytes / (plane * sizeof(float)));
+  const unsigned int num_readers =
+      std::max(1u, std::min(max_readers, std::thread::hardware_concurrency()));
+
+  const float_reader reader(filename, dset, dims);
+
+  m_array.resize(q, nx, ny, nz, layout);
+
+  // run length of the voxels of a work item, which combines its results
+  // with the others once
+  constexpr size_t run = 256;
+
+  // value range of every component, used by the 16 bit integer storage,
+  // then the max error, the sum of squared errors and the max magnitude
+  float stats[9] = {INFINITY, INFINITY, INFINITY, -INFINITY, -INFINITY,
+                    -INFINITY, 0.0f,  0.0f,     0.0f};
+  float *d_stats = sycl::malloc_device<float>(9, q);
+  q.memcpy(d_stats, stats, sizeof(stats)).wait();
+
+  using atomic_float =
+      sycl::atomic_ref<float, sycl::memory_order::relaxed,
+                       sycl::memory_scope::device,
+                       sycl::access::address_space::global_space>;
 
-  std::vector<sycl::float4> padded(nx * ny * nz);
-  for (size_t i = 0; i < padded.size(); ++i) {
-    padded[i] = {rawData[i * 3 + 0], rawData[i * 3 + 1], rawData[i * 3 + 2],
-                 1.0f};
+  // only the quantized storage needs the range before encoding, at the cost
+  // of reading the planes twice
+  if (std::is_same<Voxel, voxel_short3>::value) {
+    stream_slabs(q, reader, begin, end, slab_planes * plane, num_readers,
+                 [&](const float *slab, size_t, size_t count,
+                     sycl::event upload) {
+                   return q.parallel_for(
+                       sycl::range<1>((count + run - 1) / run), upload,
+                       [=](sycl::id<1> id) {
+                         const size_t a = id[0] * run;
+                         const size_t b = sycl::min(a + run, count);
+
+                         float lo[3] = {INFINITY, INFINITY, INFINITY};
+                         float hi[3] = {-INFINITY, -INFINITY, -INFINITY};
+                         for (size_t n = a; n < b; ++n)
+                           for (int c = 0; c < 3; ++c) {
+                             lo[c] = sycl::fmin(lo[c], slab[n * 3 + c]);
+                             hi[c] = sycl::fmax(hi[c], slab[n * 3 + c]);
+                           }
+
+                         for (int c = 0; c < 3; ++c) {
+                           atomic_float(d_stats[c]).fetch_min(lo[c]);
+                           atomic_float(d_stats[3 + c]).fetch_max(hi[c]);
+                         }
+                       });
+                 });
+
+    q.memcpy(stats, d_stats, sizeof(stats)).wait();
   }
 
-  m_array.resize(q, nx, ny, nz);
-  m_array.copy_to_device(q, padded);
+  const float *lo = stats;
+  const float *hi = stats + 3;
+  m_array.set_range({0.5f * (hi[0] - lo[0]), 0.5f * (hi[1] - lo[1]),
+                     0.5f * (hi[2] - lo[2])},
+                    {0.5f * (hi[0] + lo[0]), 0.5f * (hi[1] + lo[1]),
+                     0.5f * (hi[2] + lo[2])});
+
+  // encode into the array, and measure the error against the float values
+  const size_t num_voxels = size_t(nx) * ny * nz;
+  uint8_t *d_valid = sycl::malloc_device<uint8_t>(num_voxels, q);
+  const array3D<Voxel> array = m_array;
+
+  stream_slabs(
+      q, reader, begin, end, slab_planes * plane, num_readers,
+      [&](const float *slab, size_t first, size_t count, sycl::event upload) {
+        return q.parallel_for(
+            sycl::range<1>((count + run - 1) / run), upload,
+            [=](sycl::id<1> id) {
+              const size_t a = id[0] * run;
+              const size_t b = sycl::min(a + run, count);
+              const sycl::global_ptr<Voxel> data = array.data();
+
+              float max_error = 0.0f, sum_error = 0.0f, max_norm = 0.0f;
+              for (size_t n = a; n < b; ++n) {
+                const sycl::float3 v = {slab[n * 3 + 0], slab[n * 3 + 1],
+                                        slab[n * 3 + 2]};
+                const size_t g = first + n;
+                const Voxel voxel = array.encode(v);
+
+                data[array.index(g % nx, g / nx % ny, g / nx / ny)] = voxel;
+
+                // voxels without a finite value mark the outside of the
+                // domain
+                const bool valid = sycl::isfinite(v.x()) &&
+                                   sycl::isfinite(v.y()) &&
+                                   sycl::isfinite(v.z());
+                d_valid[g] = valid;
+                if (!valid)
+                  continue;
+
+                const float error = sycl::length(array.decode(voxel) - v);
+                max_error = sycl::fmax(max_error, error);
+                sum_error += error * error;
+                max_norm = sycl::fmax(max_norm, sycl::length(v));
+              }
+
+              atomic_float(d_stats[6]).fetch_max(max_error);
+              atomic_float(d_stats[7]).fetch_add(sum_error);
+              atomic_float(d_stats[8]).fetch_max(max_norm);
+            });
+      });
+
+  // a cell is valid if all its eight corner voxels are; a work item builds
+  // one word of the mask
+  const size_t num_cells = m_array.num_cells();
+  const sycl::global_ptr<uint32_t> mask = m_array.mask();
+
+  q.parallel_for(sycl::range<1>(m_array.mask_size()), [=](sycl::id<1> w) {
+     auto voxel = [&](size_t i, size_t j, size_t k) {
+       return d_valid[(k * ny + j) * nx + i] != 0;
+     };
+
+     uint32_t word = 0;
+     for (size_t bit = 0; bit < 32 && w[0] * 32 + bit < num_cells; ++bit) {
+       const size_t c = w[0] * 32 + bit;
+       const size_t i = c % (nx - 1);
+       const size_t j = c / (nx - 1) % (ny - 1);
+       const size_t k = c / (nx - 1) / (ny - 1);
+
+       if (voxel(i, j, k) && voxel(i + 1, j, k) && voxel(i, j + 1, k) &&
+           voxel(i + 1, j + 1, k) && voxel(i, j, k + 1) &&
+           voxel(i + 1, j, k + 1) && voxel(i, j + 1, k + 1) &&
+           voxel(i + 1, j + 1, k + 1))
+         word |= 1u << bit;
+     }
+
+     mask[w] = word;
+   }).wait();
+
+  q.memcpy(stats, d_stats, sizeof(stats)).wait();
+  sycl::free(d_stats, q);
+  sycl::free(d_valid, q);
+
+  const std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start_time;
+
+  std::cerr << "field storage " << voxel_codec<Voxel>::name << ": "
+            << sizeof(Voxel) << " bytes per voxel, "
+            << m_array.size() * sizeof(Voxel) / (1024.0 * 1024.0)
+            << " MiB, max error " << stats[6] << ", rms error "
+            << std::sqrt(stats[7] / std::max<size_t>(1, num_voxels))
+            << " (max magnitude " << stats[8] << "), loaded in "
+            << elapsed.count() << " s\n";
 
   hid_t scale_dset = H5Dopen(file, "/scale", H5P_DEFAULT);
   float scale[3];
   H5Dread(scale_dset, H5T_NATIVE_FLOAT, H5S_ALL, H5S_ALL, H5P_DEFAULT, scale);
   // m_scale = float3(scale[0], scale[1], scale[2]);
-  sycl::float3 m_scale = {scale[0], scale[1], scale[2]};
+  m_scale = {scale[0], scale[1], scale[2]};
 
   // If you saved spacing as a dataset or attribute, read it here:
   H5Dclose(dset);
@@ -62,7 +544,678 @@ hdf5_field::hdf5_field(sycl::queue &q, const std::string &filename)
   H5Fclose(file);
 
   // m_offset = sycl::float3(0.0f, 0.0f, 0.0f);
-  sycl::float3 m_offset = {0.0f, 0.0f, 0.0f};
+  // the first loaded plane is plane 0 of the array
+  m_offset = {0.0f, 0.0f, z_begin / m_scale.z()};
+}
+
+// -------------------------------------------------------------------------
+
+template <typename Voxel>
+bool hdf5_field<Voxel>::load_cache(sycl::queue &q, const std::string &path,
+                                   uint64_t hash, array_layout layout,
+                                   int z_begin, int z_end) {
+  const auto start_time = std::chrono::steady_clock::now();
+
+  const int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0)
+    return false;
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || size_t(st.st_size) < sizeof(field_cache_header)) {
+    close(fd);
+    return false;
+  }
+
+  const size_t size = st.st_size;
+  void *mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+
+  if (mapped == MAP_FAILED)
+    return false;
+
+  const char *bytes = static_cast<const char *>(mapped);
+  field_cache_header header;
+  std::memcpy(&header, bytes, sizeof(header));
+
+  bool fresh =
+      std::memcmp(header.magic, field_cache_magic, sizeof(header.magic)) ==
+          0 &&
+      header.version == field_cache_version &&
+      header.voxel_size == sizeof(Voxel) &&
+      std::strncmp(header.codec, voxel_codec<Voxel>::name,
+                   sizeof(header.codec)) == 0 &&
+      header.layout == uint32_t(layout) && header.z_begin == z_begin &&
+      header.z_end == z_end && header.source_hash == hash &&
+      header.data_offset + header.data_bytes <= size &&
+      header.mask_offset + header.mask_bytes <= size;
+
+  if (fresh) {
+    m_array.resize(q, header.nx, header.ny, header.nz, layout);
+
+    // a cache that does not match its own header is rebuilt
+    fresh = header.data_bytes == m_array.size() * sizeof(Voxel) &&
+            header.mask_bytes == m_array.mask_size() * sizeof(uint32_t);
+
+    if (!fresh) {
+      sycl::free(m_array.data().get(), q);
+      sycl::free(m_array.mask().get(), q);
+      m_array = array3D<Voxel>();
+    }
+  }
+
+  if (fresh) {
+    madvise(mapped, size, MADV_SEQUENTIAL);
+
+    q.memcpy(m_array.data().get(), bytes + header.data_offset,
+             header.data_bytes);
+    q.memcpy(m_array.mask().get(), bytes + header.mask_offset,
+             header.mask_bytes);
+    q.wait();
+
+    m_array.set_range({header.range_scale[0], header.range_scale[1],
+                       header.range_scale[2]},
+                      {header.range_offset[0], header.range_offset[1],
+                       header.range_offset[2]});
+    m_scale = {header.scale[0], header.scale[1], header.scale[2]};
+    m_offset = {header.offset[0], header.offset[1], header.offset[2]};
+
+    const std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start_time;
+
+    std::cerr << "field storage " << voxel_codec<Voxel>::name << ": "
+              << sizeof(Voxel) << " bytes per voxel, "
+              << header.data_bytes / (1024.0 * 1024.0) << " MiB, loaded from "
+              << path << " in " << elapsed.count() << " s\n";
+  }
+
+  munmap(mapped, size);
+
+  return fresh;
+}
+
+// -------------------------------------------------------------------------
+
+template <typename Voxel>
+void hdf5_field<Voxel>::save_cache(sycl::queue &q, const std::string &path,
+                                   uint64_t hash, array_layout layout,
+                                   int z_begin, int z_end) const {
+  field_cache_header header = {};
+  std::memcpy(header.magic, field_cache_magic, sizeof(header.magic));
+  header.version = field_cache_version;
+  header.voxel_size = sizeof(Voxel);
+  std::strncpy(header.codec, voxel_codec<Voxel>::name, sizeof(header.codec));
+  header.layout = uint32_t(layout);
+  header.z_begin = z_begin;
+  header.z_end = z_end;
+  header.nx = m_array.nx();
+  header.ny = m_array.ny();
+  header.nz = m_array.nz();
+  header.source_hash = hash;
+
+  const sycl::float3 range_scale = m_array.range_scale();
+  const sycl::float3 range_offset = m_array.range_offset();
+  for (int c = 0; c < 3; ++c) {
+    header.range_scale[c] = range_scale[c];
+    header.range_offset[c] = range_offset[c];
+    header.scale[c] = m_scale[c];
+    header.offset[c] = m_offset[c];
+  }
+
+  header.data_offset = align_up(sizeof(header), field_cache_alignment);
+  header.data_bytes = m_array.size() * sizeof(Voxel);
+  header.mask_offset = align_up(header.data_offset + header.data_bytes,
+                                field_cache_alignment);
+  header.mask_bytes = m_array.mask_size() * sizeof(uint32_t);
+
+  const size_t size = header.mask_offset + header.mask_bytes;
+
+  // written under a temporary name and renamed, so that concurrent jobs
+  // never map a partial file
+  const std::string temporary = path + ".tmp." + std::to_string(getpid());
+
+  const int fd = open(temporary.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0 || ftruncate(fd, size) != 0) {
+    std::cerr << "cannot write field cache " << path << "\n";
+    if (fd >= 0) {
+      close(fd);
+      unlink(temporary.c_str());
+    }
+    return;
+  }
+
+  void *mapped = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+
+  if (mapped == MAP_FAILED) {
+    std::cerr << "cannot write field cache " << path << "\n";
+    unlink(temporary.c_str());
+    return;
+  }
+
+  char *bytes = static_cast<char *>(mapped);
+  std::memcpy(bytes, &header, sizeof(header));
+
+  q.memcpy(bytes + header.data_offset, m_array.data().get(),
+           header.data_bytes);
+  q.memcpy(bytes + header.mask_offset, m_array.mask().get(),
+           header.mask_bytes);
+  q.wait();
+
+  const bool written = msync(mapped, size, MS_SYNC) == 0;
+  munmap(mapped, size);
+
+  if (!written || rename(temporary.c_str(), path.c_str()) != 0) {
+    std::cerr << "cannot write field cache " << path << "\n";
+    unlink(temporary.c_str());
+    return;
+  }
+
+  std::cerr << "field cache written to " << path << "\n";
+}
+
+template struct hdf5_field<voxel_float3>;
+template struct hdf5_field<voxel_half3>;
+template struct hdf5_field<voxel_short3>;
+
+// -------------------------------------------------------------------------
+
+hdf5_timeseries::hdf5_timeseries(sycl::queue &q, const std::string &filename)
+    : m_q(q) {
+  // the series of other devices may be prefetching already
+  std::unique_lock<std::mutex> lock(hdf5_mutex);
+
+  m_file = H5Fopen(filename.c_str(), H5F_ACC_RDONLY, H5P_DEFAULT);
+
+  if (m_file < 0)
+    throw std::runtime_error("Failed to open HDF5 file");
+
+  m_dset = H5Dopen(m_file, "/field", H5P_DEFAULT);
+  if (m_dset < 0)
+    throw std::runtime_error("Failed to open HDF5 dataset");
+
+  hid_t space = H5Dget_space(m_dset);
+  int ndims = H5Sget_simple_extent_ndims(space);
+  if (ndims != 5)
+    throw std::runtime_error("Expected 5D dataset");
+
+  H5Sget_simple_extent_dims(space, m_dims, nullptr);
+  H5Sclose(space);
+
+  if (m_dims[0] < 2)
+    throw std::runtime_error("Expected at least two time slices");
+
+  unsigned int ny = m_dims[1];
+  unsigned int nx = m_dims[2];
+  unsigned int nz = m_dims[3];
+
+  // slice times, one unit apart unless given in the file
+  m_times.resize(m_dims[0]);
+  for (size_t n = 0; n < m_times.size(); ++n)
+    m_times[n] = n;
+
+  if (H5Lexists(m_file, "/time", H5P_DEFAULT) > 0) {
+    hid_t time_dset = H5Dopen(m_file, "/time", H5P_DEFAULT);
+    H5Dread(time_dset, H5T_NATIVE_FLOAT, H5S_ALL, H5S_ALL, H5P_DEFAULT,
+            m_times.data());
+    H5Dclose(time_dset);
+  }
+
+  hid_t scale_dset = H5Dopen(m_file, "/scale", H5P_DEFAULT);
+  float scale[3];
+  H5Dread(scale_dset, H5T_NATIVE_FLOAT, H5S_ALL, H5S_ALL, H5P_DEFAULT, scale);
+  H5Dclose(scale_dset);
+
+  lock.unlock();
+
+  m_scale = {scale[0], scale[1], scale[2]};
+  m_offset = {0.0f, 0.0f, 0.0f};
+
+  for (auto &slot : m_slots)
+    slot.resize(q, nx, ny, nz);
+
+  upload(0);
+  upload(1);
+  prefetch(2);
 }
 
 // -------------------------------------------------------------------------
+
+hdf5_timeseries::~hdf5_timeseries() {
+  // the background read still uses the file
+  if (m_next.valid())
+    m_next.wait();
+
+  for (auto &slot : m_slots) {
+    sycl::free(slot.data().get(), m_q);
+    sycl::free(slot.mask().get(), m_q);
+  }
+
+  std::lock_guard<std::mutex> lock(hdf5_mutex);
+  H5Dclose(m_dset);
+  H5Fclose(m_file);
+}
+
+// -------------------------------------------------------------------------
+
+hdf5_timeseries::slice hdf5_timeseries::read(unsigned int n) const {
+  const size_t num_voxels = m_dims[1] * m_dims[2] * m_dims[3];
+
+  // select slice n
+  hsize_t start[5] = {n, 0, 0, 0, 0};
+  hsize_t count[5] = {1, m_dims[1], m_dims[2], m_dims[3], m_dims[4]};
+
+  std::vector<float> rawData(num_voxels * 3);
+  {
+    // called from the prefetch and from the threads of several devices
+    std::lock_guard<std::mutex> lock(hdf5_mutex);
+
+    hid_t space = H5Dget_space(m_dset);
+    H5Sselect_hyperslab(space, H5S_SELECT_SET, start, nullptr, count,
+                        nullptr);
+    hid_t memspace = H5Screate_simple(5, count, nullptr);
+
+    H5Dread(m_dset, H5T_NATIVE_FLOAT, memspace, space, H5P_DEFAULT,
+            rawData.data());
+
+    H5Sclose(memspace);
+    H5Sclose(space);
+  }
+
+  slice data;
+  data.voxels.resize(num_voxels);
+  std::vector<bool> voxel_valid(num_voxels);
+  for (size_t i = 0; i < num_voxels; ++i) {
+    data.voxels[i] = {rawData[i * 3 + 0], rawData[i * 3 + 1],
+                      rawData[i * 3 + 2]};
+    voxel_valid[i] = std::isfinite(rawData[i * 3 + 0]) &&
+                     std::isfinite(rawData[i * 3 + 1]) &&
+                     std::isfinite(rawData[i * 3 + 2]);
+  }
+
+  // all slots have the same size
+  data.mask = m_slots[0].cell_mask(voxel_valid);
+
+  return data;
+}
+
+// -------------------------------------------------------------------------
+
+void hdf5_timeseries::upload(unsigned int n) {
+  const unsigned int slot = n % 3;
+
+  if (m_resident[slot] == int(n))
+    return;
+
+  slice data;
+
+  if (m_next_slice == int(n)) {
+    data = m_next.get();
+    m_next_slice = -1;
+  } else {
+    // HDF5 is not reentrant: let the background read finish first
+    if (m_next.valid())
+      m_next.wait();
+
+    data = read(n);
+  }
+
+  // kernels submitted with an older view may still read the slot
+  m_q.wait();
+
+  m_slots[slot].copy_to_device(m_q, data.voxels);
+  m_slots[slot].copy_mask_to_device(m_q, data.mask);
+  m_resident[slot] = n;
+}
+
+// -------------------------------------------------------------------------
+
+void hdf5_timeseries::prefetch(unsigned int n) {
+  if (n >= m_times.size() || m_resident[n % 3] == int(n) ||
+      m_next_slice == int(n))
+    return;
+
+  // only one slice is read ahead at a time
+  if (m_next.valid())
+    m_next.wait();
+
+  m_next = std::async(std::launch::async, [this, n]() { return read(n); });
+  m_next_slice = n;
+}
+
+// -------------------------------------------------------------------------
+
+pathline_field hdf5_timeseries::view(float t_begin, float t_end) {
+  const unsigned int num_slices = m_times.size();
+
+  // the interval [t_n, t_n+1] containing t_begin
+  unsigned int n = 0;
+  while (n + 2 < num_slices && m_times[n + 1] <= t_begin)
+    ++n;
+
+  upload(n);
+  upload(n + 1);
+
+  pathline_field field;
+  field.m_offset = m_offset;
+  field.m_scale = m_scale;
+
+  for (int i = 0; i < 2; ++i) {
+    field.m_slice[i] = m_slots[(n + i) % 3];
+    field.m_time[i] = m_times[n + i];
+  }
+
+  // stop at slice n+1 unless slice n+2 is resident
+  field.m_slice[2] = field.m_slice[1];
+  field.m_time[2] = field.m_time[1];
+
+  if (n + 2 < num_slices) {
+    // take slice n+2 as soon as the background read has finished, and wait
+    // for it only if this launch integrates past t_n+1
+    const bool ready =
+        m_next_slice == int(n + 2) &&
+        m_next.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+
+    if (ready || t_end > m_times[n + 1])
+      upload(n + 2);
+
+    if (m_resident[(n + 2) % 3] == int(n + 2)) {
+      field.m_slice[2] = m_slots[(n + 2) % 3];
+      field.m_time[2] = m_times[n + 2];
+
+      prefetch(n + 3);
+    } else {
+      prefetch(n + 2);
+    }
+  }
+
+  return field;
+}
+
+// -------------------------------------------------------------------------
+
+// -------------------------------------------------------------------------
+
+hdf5_brick_field::hdf5_brick_field(sycl::queue &q, const std::string &filename,
+                                   unsigned int capacity)
+    : m_q(q) {
+  std::unique_lock<std::mutex> lock(hdf5_mutex);
+
+  m_file = H5Fopen(filename.c_str(), H5F_ACC_RDONLY, H5P_DEFAULT);
+
+  if (m_file < 0)
+    throw std::runtime_error("Failed to open HDF5 file");
+
+  m_dset = H5Dopen(m_file, "/field", H5P_DEFAULT);
+  if (m_dset < 0)
+    throw std::runtime_error("Failed to open HDF5 dataset");
+
+  hid_t space = H5Dget_space(m_dset);
+  if (H5Sget_simple_extent_ndims(space) != 4)
+    throw std::runtime_error("Expected 4D dataset");
+
+  hsize_t dims[4];
+  H5Sget_simple_extent_dims(space, dims, nullptr);
+  H5Sclose(space);
+
+  // the axes of hdf5_field
+  m_ny = dims[0];
+  m_nx = dims[1];
+  m_nz = dims[2];
+
+  const int cells = brick_field_view::brick_cells;
+  m_bx = (m_nx - 1 + cells - 1) / cells;
+  m_by = (m_ny - 1 + cells - 1) / cells;
+  m_bz = (m_nz - 1 + cells - 1) / cells;
+
+  hid_t scale_dset = H5Dopen(m_file, "/scale", H5P_DEFAULT);
+  float scale[3];
+  H5Dread(scale_dset, H5T_NATIVE_FLOAT, H5S_ALL, H5S_ALL, H5P_DEFAULT, scale);
+  H5Dclose(scale_dset);
+
+  lock.unlock();
+
+  m_scale = {scale[0], scale[1], scale[2]};
+
+  const size_t num_bricks = size_t(m_bx) * m_by * m_bz;
+
+  // there is no point in more slots than bricks
+  capacity = std::min<size_t>(capacity, num_bricks);
+  m_capacity = capacity;
+  m_slot_brick.assign(capacity, -1);
+
+  m_pool = sycl::malloc_device<voxel_float3>(
+      size_t(capacity) * brick_field_view::brick_voxels, q);
+  m_masks = sycl::malloc_device<uint32_t>(
+      size_t(capacity) * brick_field_view::brick_mask_words, q);
+  m_page_table = sycl::malloc_device<int>(num_bricks, q);
+  m_slot_used = sycl::malloc_device<unsigned int>(capacity, q);
+  m_requested = sycl::malloc_device<uint32_t>(num_bricks, q);
+  m_requests = sycl::malloc_device<unsigned int>(capacity, q);
+  m_num_requests = sycl::malloc_device<unsigned int>(1, q);
+
+  q.fill(m_page_table, -1, num_bricks);
+  q.memset(m_slot_used, 0, capacity * sizeof(unsigned int));
+  q.memset(m_requested, 0, num_bricks * sizeof(uint32_t));
+  q.memset(m_num_requests, 0, sizeof(unsigned int));
+  q.wait();
+
+  std::cerr << "brick cache: " << capacity << " of " << num_bricks
+            << " bricks, "
+            << capacity * (brick_field_view::brick_voxels *
+                               sizeof(voxel_float3) +
+                           brick_field_view::brick_mask_words *
+                               sizeof(uint32_t)) /
+                   (1024.0 * 1024.0)
+            << " MiB\n";
+}
+
+// -------------------------------------------------------------------------
+
+hdf5_brick_field::~hdf5_brick_field() {
+  sycl::free(m_pool, m_q);
+  sycl::free(m_masks, m_q);
+  sycl::free(m_page_table, m_q);
+  sycl::free(m_slot_used, m_q);
+  sycl::free(m_requested, m_q);
+  sycl::free(m_requests, m_q);
+  sycl::free(m_num_requests, m_q);
+
+  std::lock_guard<std::mutex> lock(hdf5_mutex);
+  H5Dclose(m_dset);
+  H5Fclose(m_file);
+}
+
+// -------------------------------------------------------------------------
+
+brick_field_view hdf5_brick_field::view() const {
+  brick_field_view view;
+  view.pool = m_pool;
+  view.masks = m_masks;
+  view.page_table = m_page_table;
+  view.slot_used = m_slot_used;
+  view.requested = m_requested;
+  view.requests = m_requests;
+  view.num_requests = m_num_requests;
+  view.request_capacity = m_capacity;
+  view.launch = m_launch;
+  view.nx = m_nx;
+  view.ny = m_ny;
+  view.nz = m_nz;
+  view.bx = m_bx;
+  view.by = m_by;
+  view.offset = {0.0f, 0.0f, 0.0f};
+  view.scale = m_scale;
+  return view;
+}
+
+// -------------------------------------------------------------------------
+
+void hdf5_brick_field::read(unsigned int b, std::vector<voxel_float3> &voxels,
+                            std::vector<uint32_t> &mask) const {
+  const int cells = brick_field_view::brick_cells;
+  const int side = cells + 1;
+
+  const int i0 = (b % m_bx) * cells;
+  const int j0 = (b / m_bx % m_by) * cells;
+  const int k0 = (b / m_bx / m_by) * cells;
+
+  // the part of the brick inside the grid
+  const int ni = std::min(side, m_nx - i0);
+  const int nj = std::min(side, m_ny - j0);
+  const int nk = std::min(side, m_nz - k0);
+
+  // the voxels are those of hdf5_field, which reads the flattened dataset
+  // (ny, nx, nz, 3) as [nz][ny][nx]: every row of the brick is a run of ni
+  // voxels in storage order. The runs are selected as hyperslabs of the
+  // dataset, split where they wrap around its third axis, and read at once;
+  // HDF5 returns them in storage order, the order of the rows.
+  const hsize_t num_floats = hsize_t(nk) * nj * ni * 3;
+  std::vector<float> rawData(num_floats);
+  {
+    std::lock_guard<std::mutex> lock(hdf5_mutex);
+
+    hid_t space = H5Dget_space(m_dset);
+    H5S_seloper_t op = H5S_SELECT_SET;
+
+    for (int k = 0; k < nk; ++k)
+      for (int j = 0; j < nj; ++j) {
+        hsize_t v = (hsize_t(k0 + k) * m_ny + j0 + j) * m_nx + i0;
+
+        for (hsize_t left = ni; left > 0;) {
+          const hsize_t c = v % m_nz;
+          const hsize_t n = std::min<hsize_t>(left, m_nz - c);
+          const hsize_t start[4] = {v / m_nz / m_nx, v / m_nz % m_nx, c, 0};
+          const hsize_t count[4] = {1, 1, n, 3};
+
+          H5Sselect_hyperslab(space, op, start, nullptr, count, nullptr);
+          op = H5S_SELECT_OR;
+          v += n;
+          left -= n;
+        }
+      }
+
+    hid_t memspace = H5Screate_simple(1, &num_floats, nullptr);
+    const herr_t status = H5Dread(m_dset, H5T_NATIVE_FLOAT, memspace, space,
+                                  H5P_DEFAULT, rawData.data());
+
+    H5Sclose(memspace);
+    H5Sclose(space);
+
+    if (status < 0)
+      throw std::runtime_error("Failed to read HDF5 brick");
+  }
+
+  // voxels beyond the grid are invalid
+  voxels.assign(brick_field_view::brick_voxels, {NAN, NAN, NAN});
+  std::vector<bool> voxel_valid(voxels.size(), false);
+
+  for (int k = 0; k < nk; ++k) {
+    for (int j = 0; j < nj; ++j)
+      for (int i = 0; i < ni; ++i) {
+        const float *v = &rawData[((size_t(k) * nj + j) * ni + i) * 3];
+        const size_t n = (k * side + j) * side + i;
+
+        voxels[n] = {v[0], v[1], v[2]};
+        voxel_valid[n] =
+            std::isfinite(v[0]) && std::isfinite(v[1]) && std::isfinite(v[2]);
+      }
+  }
+
+  mask.assign(brick_field_view::brick_mask_words, 0u);
+
+  auto voxel = [&](int i, int j, int k) {
+    return voxel_valid[(k * side + j) * side + i];
+  };
+
+  for (int k = 0, c = 0; k < cells; ++k)
+    for (int j = 0; j < cells; ++j)
+      for (int i = 0; i < cells; ++i, ++c)
+        if (voxel(i, j, k) && voxel(i + 1, j, k) && voxel(i, j + 1, k) &&
+            voxel(i + 1, j + 1, k) && voxel(i, j, k + 1) &&
+            voxel(i + 1, j, k + 1) && voxel(i, j + 1, k + 1) &&
+            voxel(i + 1, j + 1, k + 1))
+          mask[c >> 5] |= 1u << (c & 31);
+}
+
+// -------------------------------------------------------------------------
+
+unsigned int hdf5_brick_field::load_requested() {
+  unsigned int num_requests = 0;
+  m_q.memcpy(&num_requests, m_num_requests, sizeof(unsigned int)).wait();
+  num_requests = std::min(num_requests, m_capacity);
+
+  if (num_requests == 0) {
+    ++m_launch;
+    return 0;
+  }
+
+  std::vector<unsigned int> requests(num_requests);
+  std::vector<unsigned int> slot_used(m_capacity);
+  m_q.memcpy(requests.data(), m_requests, num_requests * sizeof(unsigned int));
+  m_q.memcpy(slot_used.data(), m_slot_used,
+             m_capacity * sizeof(unsigned int));
+  m_q.wait();
+
+  // at most half of the cache is replaced at a time, so that the bricks
+  // used by the last launch mostly stay
+  const unsigned int num_loads =
+      std::min(num_requests, std::max(1u, m_capacity / 2));
+
+  // free slots first, then the least recently used
+  std::vector<unsigned int> slots(m_capacity);
+  for (unsigned int s = 0; s < m_capacity; ++s)
+    slots[s] = s;
+
+  std::partial_sort(slots.begin(), slots.begin() + num_loads, slots.end(),
+                    [&](unsigned int a, unsigned int b) {
+                      if ((m_slot_brick[a] < 0) != (m_slot_brick[b] < 0))
+                        return m_slot_brick[a] < 0;
+                      return slot_used[a] < slot_used[b];
+                    });
+
+  std::vector<voxel_float3> voxels;
+  std::vector<uint32_t> mask;
+  const int not_resident = -1;
+
+  for (unsigned int n = 0; n < num_loads; ++n) {
+    const unsigned int slot = slots[n];
+    const int brick = requests[n];
+
+    if (m_slot_brick[slot] >= 0) {
+      m_q.memcpy(m_page_table + m_slot_brick[slot], &not_resident,
+                 sizeof(int))
+          .wait();
+      ++m_evictions;
+    }
+
+    read(brick, voxels, mask);
+
+    m_q.memcpy(m_pool + size_t(slot) * brick_field_view::brick_voxels,
+               voxels.data(), voxels.size() * sizeof(voxel_float3));
+    m_q.memcpy(m_masks + size_t(slot) * brick_field_view::brick_mask_words,
+               mask.data(), mask.size() * sizeof(uint32_t));
+    m_q.memcpy(m_page_table + brick, &slot, sizeof(int));
+    m_q.wait();
+
+    m_slot_brick[slot] = brick;
+    ++m_loads;
+  }
+
+  // bricks that were not loaded are requested again by the next launch
+  m_q.parallel_for(sycl::range<1>(num_requests),
+                   [requested = m_requested, requests = m_requests](
+                       sycl::id<1> n) { requested[requests[n]] = 0u; });
+  m_q.memset(m_num_requests, 0, sizeof(unsigned int));
+  m_q.wait();
+
+  ++m_launch;
+
+  return num_loads;
+}
+
+// -------------------------------------------------------------------------
+
+void hdf5_brick_field::print_statistics() const {
+  std::cerr << "brick cache: " << m_loads << " brick loads, " << m_evictions
+            << " evictions\n";
+}
@@ -1,17 +1,39 @@
 #ifndef __hdf5_field_sycl_hpp
 #define __hdf5_field_sycl_hpp
 
-#include "array3d_sycl.h"
+#include "array3d_sycl_1.h"
 #include "floatn.hpp"
 #include <sycl/sycl.hpp>
 
+#include "hdf5.h"
+
+#include <future>
+#include <mutex>
+#include <string>
+#include <vector>
+
 // namespace sycl = cl::sycl;
 
 // -------------------------------------------------------------------------
 
-struct hdf5_field {
-  /// initialize from HDF5 file
-  hdf5_field(sycl::queue &q, const std::string &filename);
+/// HDF5 is not reentrant; all calls that may run on several threads at once,
+/// from reader threads, prefetches, the threads of several devices and the
+/// trajectory writers, go through this
+extern std::mutex hdf5_mutex;
+
+// -------------------------------------------------------------------------
+
+/// steady field, stored on the device with packed voxels of type Voxel:
+/// voxel_float3, voxel_half3 or voxel_short3 (see voxel_codec)
+template <typename Voxel = voxel_float3> struct hdf5_field {
+  /// initialize from HDF5 file, storing the voxels in the given layout.
+  /// Only the z planes [z_begin, z_end) are loaded, by default all of them;
+  /// positions stay in the coordinates of the whole field. With a cache
+  /// file, the encoded voxels are mapped from it if it was made from the
+  /// same file with the same settings, and written to it otherwise.
+  hdf5_field(sycl::queue &q, const std::string &filename,
+             array_layout layout = array_layout::linear, int z_begin = 0,
+             int z_end = -1, const std::string &cache = "");
 
   /// get the interpolated field value at pos
   bool get(sycl::float3 pos, sycl::float3 &result) const {
@@ -28,23 +50,423 @@ struct hdf5_field {
     //     sycl::float4
     //   });
     // })
-    sycl::global_ptr<const sycl::float4> d_data = m_array.data();
-    sycl::float4 r = m_array.get(d_data, pos.x(), pos.y(), pos.z());
+    // cells outside the domain are marked in the validity mask
+    if (!m_array.valid(pos.x(), pos.y(), pos.z()))
+      return false;
+
+    sycl::global_ptr<const Voxel> d_data = m_array.data();
+    result = m_array.get(d_data, pos.x(), pos.y(), pos.z());
+
+    return true;
+  }
+
+  /// pos in the index space of the grid
+  sycl::float3 grid_position(sycl::float3 pos) const {
+    return {(pos.x() - m_offset.x()) * m_scale.x(),
+            (pos.y() - m_offset.y()) * m_scale.y(),
+            (pos.z() - m_offset.z()) * m_scale.z()};
+  }
+
+  /// steady field: the value does not depend on time
+  bool get(sycl::float3 pos, float, sycl::float3 &result) const {
+    return get(pos, result);
+  }
+
+  /// per-particle corner cache, see cached_view
+  using cache = cell_cache;
+
+  /// get the interpolated field value at pos, reusing the cached corners
+  bool get(sycl::float3 pos, float, sycl::float3 &result,
+           cache &corners) const {
+    const sycl::float3 g = grid_position(pos);
+    return m_array.sample(g.x(), g.y(), g.z(), corners, result);
+  }
 
-    result.x() = r.x();
-    result.y() = r.y();
-    result.z() = r.z();
+  /// the view used by the kernels integrating from t_begin to t_end, and
+  /// the time up to which it is valid
+  const hdf5_field &view(float, float) const { return *this; }
+  float end_time() const { return INFINITY; }
 
-    std::cout << "Interpolated value at w is " << r.x() << r.y() << r.z()
-              << r.w() << std::endl;
+  /// the voxels, and the mapping of positions to their index space
+  const array3D<Voxel> &array() const { return m_array; }
+  sycl::float3 offset() const { return m_offset; }
+  sycl::float3 scale() const { return m_scale; }
 
-    return r.w() == 1.0;
+  /// the corners of the box covered by the voxels
+  sycl::float3 lower() const { return m_offset; }
+  sycl::float3 upper() const {
+    const sycl::int3 n = m_array.dims();
+    return {m_offset.x() + (n.x() - 1) / m_scale.x(),
+            m_offset.y() + (n.y() - 1) / m_scale.y(),
+            m_offset.z() + (n.z() - 1) / m_scale.z()};
   }
 
 protected:
-  array3D<sycl::float4> m_array;
+  array3D<Voxel> m_array;
+  sycl::float3 m_offset;
+  sycl::float3 m_scale;
+
+private:
+  /// load the planes [z_begin, z_end) from the HDF5 file
+  void read(sycl::queue &q, const std::string &filename, array_layout layout,
+            int z_begin, int z_end);
+
+  /// load from the cache file at path if it is fresh: made from a source
+  /// with the given hash, with the same voxel type, layout and planes
+  bool load_cache(sycl::queue &q, const std::string &path, uint64_t hash,
+                  array_layout layout, int z_begin, int z_end);
+
+  void save_cache(sycl::queue &q, const std::string &path, uint64_t hash,
+                  array_layout layout, int z_begin, int z_end) const;
+};
+
+extern template struct hdf5_field<voxel_float3>;
+extern template struct hdf5_field<voxel_half3>;
+extern template struct hdf5_field<voxel_short3>;
+
+// -------------------------------------------------------------------------
+
+/// device view of a time-varying field over up to three consecutive time
+/// slices: trilinear in space, piecewise linear in time. Times outside the
+/// resident slices are clamped.
+struct pathline_field {
+  /// get the interpolated field value at pos and time t
+  bool get(sycl::float3 pos, float t, sycl::float3 &result) const {
+    pos.x() = (pos.x() - m_offset.x()) * m_scale.x();
+    pos.y() = (pos.y() - m_offset.y()) * m_scale.y();
+    pos.z() = (pos.z() - m_offset.z()) * m_scale.z();
+
+    // the interval of resident slices containing t
+    const int i = t > m_time[1] ? 1 : 0;
+    const float span = m_time[i + 1] - m_time[i];
+    const float w =
+        span > 0.0f ? sycl::clamp((t - m_time[i]) / span, 0.0f, 1.0f) : 0.0f;
+
+    if (!m_slice[i].valid(pos.x(), pos.y(), pos.z()) ||
+        !m_slice[i + 1].valid(pos.x(), pos.y(), pos.z()))
+      return false;
+
+    sycl::float3 r0 =
+        m_slice[i].get(m_slice[i].data(), pos.x(), pos.y(), pos.z());
+    sycl::float3 r1 =
+        m_slice[i + 1].get(m_slice[i + 1].data(), pos.x(), pos.y(), pos.z());
+
+    result = r0 + w * (r1 - r0);
+
+    return true;
+  }
+
+  /// per-particle corner caches of the three slices, see cached_view
+  struct cache {
+    cell_cache slice[3];
+  };
+
+  /// get the interpolated field value at pos and time t, reusing the cached
+  /// corners of both slices
+  bool get(sycl::float3 pos, float t, sycl::float3 &result,
+           cache &corners) const {
+    pos = grid_position(pos);
+
+    const int i = t > m_time[1] ? 1 : 0;
+    const float span = m_time[i + 1] - m_time[i];
+    const float w =
+        span > 0.0f ? sycl::clamp((t - m_time[i]) / span, 0.0f, 1.0f) : 0.0f;
+
+    sycl::float3 r0, r1;
+
+    if (!m_slice[i].sample(pos.x(), pos.y(), pos.z(), corners.slice[i], r0) ||
+        !m_slice[i + 1].sample(pos.x(), pos.y(), pos.z(),
+                               corners.slice[i + 1], r1))
+      return false;
+
+    result = r0 + w * (r1 - r0);
+
+    return true;
+  }
+
+  /// pos in the index space of the grid
+  sycl::float3 grid_position(sycl::float3 pos) const {
+    return {(pos.x() - m_offset.x()) * m_scale.x(),
+            (pos.y() - m_offset.y()) * m_scale.y(),
+            (pos.z() - m_offset.z()) * m_scale.z()};
+  }
+
+  /// the last time covered by the resident slices
+  float end_time() const { return m_time[2]; }
+
+  array3D<voxel_float3> m_slice[3];
+  float m_time[3];
   sycl::float3 m_offset;
   sycl::float3 m_scale;
 };
 
+// -------------------------------------------------------------------------
+
+/// a field view together with the corner cache of one particle, to be
+/// created in the kernel and passed to the integrator in place of the view.
+/// The cache is only valid during the kernel, as views may change between
+/// launches.
+template <typename View> struct cached_view {
+  const View &view;
+  mutable typename View::cache corners = {};
+
+  bool get(sycl::float3 pos, float t, sycl::float3 &result) const {
+    return view.get(pos, t, result, corners);
+  }
+};
+
+/// add up the hits and misses of the corner caches in a cached_view
+inline void count_cache_hits(const cell_cache &c, unsigned int &hits,
+                             unsigned int &misses) {
+  hits += c.hits;
+  misses += c.misses;
+}
+
+inline void count_cache_hits(const pathline_field::cache &c,
+                             unsigned int &hits, unsigned int &misses) {
+  for (const cell_cache &slice : c.slice)
+    count_cache_hits(slice, hits, misses);
+}
+
+// -------------------------------------------------------------------------
+
+/// time-varying field stored as a 5D /field dataset (time, y, x, z, vector
+/// component) with the slice times in /time (default: 0, 1, 2, ...). Three
+/// slices are kept on the device: slices n and n+1 are integrated while
+/// slice n+2 is read from the file on a background thread.
+class hdf5_timeseries {
+public:
+  /// open the HDF5 file and load the first slices
+  hdf5_timeseries(sycl::queue &q, const std::string &filename);
+  ~hdf5_timeseries();
+
+  hdf5_timeseries(const hdf5_timeseries &) = delete;
+  hdf5_timeseries &operator=(const hdf5_timeseries &) = delete;
+
+  /// the view used by the kernels integrating from t_begin to t_end: waits
+  /// until the slices needed from t_begin on are resident and starts reading
+  /// the next one. The view may end before t_end, see end_time().
+  pathline_field view(float t_begin, float t_end);
+
+  /// the corners of the box covered by the voxels
+  sycl::float3 lower() const { return m_offset; }
+  sycl::float3 upper() const {
+    return {m_offset.x() + (m_dims[2] - 1) / m_scale.x(),
+            m_offset.y() + (m_dims[1] - 1) / m_scale.y(),
+            m_offset.z() + (m_dims[3] - 1) / m_scale.z()};
+  }
+
+private:
+  /// voxels and cell mask of one time slice
+  struct slice {
+    std::vector<voxel_float3> voxels;
+    std::vector<uint32_t> mask;
+  };
+
+  /// read slice n from the file
+  slice read(unsigned int n) const;
+
+  /// make slice n resident in its slot, waiting for it if necessary
+  void upload(unsigned int n);
+
+  /// start reading slice n on the background thread, unless it is already
+  /// resident or being read
+  void prefetch(unsigned int n);
+
+  sycl::queue &m_q;
+  hid_t m_file = -1;
+  hid_t m_dset = -1;
+  hsize_t m_dims[5];
+  std::vector<float> m_times;
+
+  array3D<voxel_float3> m_slots[3];
+  int m_resident[3] = {-1, -1, -1};
+
+  std::future<slice> m_next;
+  int m_next_slice = -1;
+
+  sycl::float3 m_offset;
+  sycl::float3 m_scale;
+};
+
+// -------------------------------------------------------------------------
+
+/// device view of an out-of-core field: the grid is split into bricks of
+/// brick_cells^3 cells, of which only those listed in the page table are
+/// resident in a pool of slots. A brick stores the corner voxels of all its
+/// cells, so neighbouring bricks share their boundary planes.
+struct brick_field_view {
+  static constexpr int brick_shift = 3;
+  static constexpr int brick_cells = 1 << brick_shift;
+  static constexpr int brick_voxels = (brick_cells + 1) * (brick_cells + 1) *
+                                      (brick_cells + 1);
+  static constexpr int brick_mask_words = brick_cells * brick_cells *
+                                          brick_cells / 32;
+
+  const voxel_float3 *pool;   // brick_voxels per slot, x fastest
+  const uint32_t *masks;      // brick_mask_words cell bits per slot
+  const int *page_table;      // slot of every brick, -1 if not resident
+  unsigned int *slot_used;    // launch that last sampled every slot
+  uint32_t *requested;        // per brick, 1 while a load is requested
+  unsigned int *requests;     // the requested bricks
+  unsigned int *num_requests; // number of requests, may exceed capacity
+  unsigned int request_capacity;
+  unsigned int launch;        // stamp for slot_used
+  int nx, ny, nz;             // voxels of the whole grid
+  int bx, by;                 // bricks along x and y
+  sycl::float3 offset;
+  sycl::float3 scale;
+
+  /// get the interpolated field value at pos. If the brick is not resident,
+  /// its load is requested and missing is set; the result is then zero and
+  /// only meant to let the caller finish its step before discarding it.
+  bool get(sycl::float3 pos, sycl::float3 &result, bool &missing) const {
+    const float x = (pos.x() - offset.x()) * scale.x();
+    const float y = (pos.y() - offset.y()) * scale.y();
+    const float z = (pos.z() - offset.z()) * scale.z();
+
+    // also rejects NaN coordinates
+    if (!(x >= 0.0f && y >= 0.0f && z >= 0.0f && x <= nx - 1 &&
+          y <= ny - 1 && z <= nz - 1))
+      return false;
+
+    const int i = sycl::min(static_cast<int>(x), nx - 2);
+    const int j = sycl::min(static_cast<int>(y), ny - 2);
+    const int k = sycl::min(static_cast<int>(z), nz - 2);
+
+    const unsigned int brick =
+        ((k >> brick_shift) * by + (j >> brick_shift)) * bx +
+        (i >> brick_shift);
+    const int slot = page_table[brick];
+
+    if (slot < 0) {
+      request(brick);
+      missing = true;
+      result = {0.0f, 0.0f, 0.0f};
+      return true;
+    }
+
+    slot_used[slot] = launch;
+
+    // the cell within the brick
+    const int ci = i & (brick_cells - 1);
+    const int cj = j & (brick_cells - 1);
+    const int ck = k & (brick_cells - 1);
+
+    const unsigned int c = (ck * brick_cells + cj) * brick_cells + ci;
+    if (!((masks[slot * brick_mask_words + (c >> 5)] >> (c & 31)) & 1u))
+      return false;
+
+    const voxel_float3 *brick_data = pool + size_t(slot) * brick_voxels;
+    auto voxel = [&](int di, int dj, int dk) {
+      const voxel_float3 &v =
+          brick_data[((ck + dk) * (brick_cells + 1) + cj + dj) *
+                         (brick_cells + 1) +
+                     ci + di];
+      return sycl::float3{v.x, v.y, v.z};
+    };
+
+    const sycl::float3 v[8] = {voxel(0, 0, 0), voxel(1, 0, 0), voxel(0, 1, 0),
+                               voxel(1, 1, 0), voxel(0, 0, 1), voxel(1, 0, 1),
+                               voxel(0, 1, 1), voxel(1, 1, 1)};
+
+    result = array3D<voxel_float3>::interpolate(v, x - i, y - j, z - k);
+
+    return true;
+  }
+
+private:
+  /// append brick to the requests, once
+  void request(unsigned int brick) const {
+    using flag = sycl::atomic_ref<uint32_t, sycl::memory_order::relaxed,
+                                  sycl::memory_scope::device,
+                                  sycl::access::address_space::global_space>;
+    using counter =
+        sycl::atomic_ref<unsigned int, sycl::memory_order::relaxed,
+                         sycl::memory_scope::device,
+                         sycl::access::address_space::global_space>;
+
+    if (flag(requested[brick]).exchange(1u) != 0u)
+      return;
+
+    const unsigned int n = counter(*num_requests).fetch_add(1u);
+
+    if (n < request_capacity)
+      requests[n] = brick;
+    else
+      flag(requested[brick]).store(0u); // request again next launch
+  }
+};
+
+/// a brick_field_view as seen by the integrators of one particle: sampling
+/// a brick that is not resident sets missing, after which the caller has to
+/// discard the step and park the particle until the brick is loaded
+struct parking_view {
+  const brick_field_view &view;
+  mutable bool missing = false;
+
+  bool get(sycl::float3 pos, float, sycl::float3 &result) const {
+    return view.get(pos, result, missing);
+  }
+};
+
+// -------------------------------------------------------------------------
+
+/// steady field that is never loaded as a whole: bricks are read with HDF5
+/// hyperslabs when the particles ask for them, into a device cache of a
+/// fixed number of bricks that evicts the least recently used one. The
+/// voxels are those of hdf5_field.
+class hdf5_brick_field {
+public:
+  /// open the HDF5 file, with room for capacity bricks on the device
+  hdf5_brick_field(sycl::queue &q, const std::string &filename,
+                   unsigned int capacity);
+  ~hdf5_brick_field();
+
+  hdf5_brick_field(const hdf5_brick_field &) = delete;
+  hdf5_brick_field &operator=(const hdf5_brick_field &) = delete;
+
+  /// the view for the next launch
+  brick_field_view view() const;
+
+  /// load the bricks requested since the last call, evicting the least
+  /// recently used ones; returns the number of loaded bricks
+  unsigned int load_requested();
+
+  sycl::float3 grid_position(sycl::float3 pos) const {
+    return {pos.x() * m_scale.x(), pos.y() * m_scale.y(),
+            pos.z() * m_scale.z()};
+  }
+
+  /// print the cache statistics
+  void print_statistics() const;
+
+private:
+  /// read brick b and build its cell mask
+  void read(unsigned int b, std::vector<voxel_float3> &voxels,
+            std::vector<uint32_t> &mask) const;
+
+  sycl::queue &m_q;
+  hid_t m_file = -1;
+  hid_t m_dset = -1;
+  int m_nx, m_ny, m_nz;
+  int m_bx, m_by, m_bz;
+  unsigned int m_capacity;
+  sycl::float3 m_scale;
+
+  // device data, see brick_field_view
+  voxel_float3 *m_pool = nullptr;
+  uint32_t *m_masks = nullptr;
+  int *m_page_table = nullptr;
+  unsigned int *m_slot_used = nullptr;
+  uint32_t *m_requested = nullptr;
+  unsigned int *m_requests = nullptr;
+  unsigned int *m_num_requests = nullptr;
+
+  // host side of the cache
+  std::vector<int> m_slot_brick; // brick in every slot, -1 if free
+  unsigned int m_launch = 1;
+  unsigned long m_loads = 0, m_evictions = 0;
+};
+
 #endif // __nrrd_field_hpp
@@ -0,0 +1,337 @@
+#ifndef __hdf5_output_hpp
+#define __hdf5_output_hpp
+
+#include "hdf5_field_sycl.h"
+#include "particles_sycl.h"
+#include "vtk_output.h"
+
+#include "hdf5.h"
+
+#include <zlib.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <exception>
+#include <iostream>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+// -------------------------------------------------------------------------
+
+/// points per chunk of the trajectory datasets, and the deflate level
+constexpr hsize_t hdf5_chunk_points = 65536;
+constexpr int hdf5_deflate_level = 1;
+
+/// create the dataset name of type in file, with components values of type
+/// T per point, and fill it: offsets index the points of every seed, see
+/// save_as_hdf5(), and gather(seed, step, values) stores the components of
+/// the given step of seed at values. The dataset is chunked with the
+/// shuffle and deflate filters. The chunks are filtered by num_threads
+/// threads and then written as they are with H5Dwrite_chunk, as HDF5 itself
+/// would only compress them one at a time. An error of any thread is thrown
+/// once all have stopped, with the dataset closed.
+template <typename T, typename Gather>
+void write_trajectory_dataset(hid_t file, const char *name, hid_t type,
+                              hsize_t components,
+                              const std::vector<int64_t> &offsets,
+                              unsigned int num_threads, Gather gather) {
+  const hsize_t num_points = offsets.back();
+  const hsize_t num_chunks =
+      (num_points + hdf5_chunk_points - 1) / hdf5_chunk_points;
+  const size_t chunk_values = hdf5_chunk_points * components;
+  const int rank = components == 1 ? 1 : 2;
+
+  // extendible along the points, so that the chunks need not fit into
+  // the dataset
+  const hsize_t dims[2] = {num_points, components};
+  const hsize_t max_dims[2] = {H5S_UNLIMITED, components};
+  const hsize_t chunk[2] = {hdf5_chunk_points, components};
+
+  hid_t space = H5Screate_simple(rank, dims, max_dims);
+  hid_t dcpl = H5Pcreate(H5P_DATASET_CREATE);
+  H5Pset_chunk(dcpl, rank, chunk);
+  H5Pset_shuffle(dcpl);
+  H5Pset_deflate(dcpl, hdf5_deflate_level);
+
+  hid_t dset =
+      H5Dcreate(file, name, type, space, H5P_DEFAULT, dcpl, H5P_DEFAULT);
+
+  H5Pclose(dcpl);
+  H5Sclose(space);
+
+  if (dset < 0)
+    throw std::runtime_error("Failed to create HDF5 dataset");
+
+  // the shuffle filter groups the n-th bytes of all values, then deflate
+  auto filter = [&](const std::vector<T> &values, std::vector<char> &out,
+                    std::vector<char> &shuffled) {
+    const size_t count = values.size();
+    const char *bytes = reinterpret_cast<const char *>(values.data());
+
+    shuffled.resize(count * sizeof(T));
+    for (size_t b = 0; b < sizeof(T); ++b)
+      for (size_t n = 0; n < count; ++n)
+        shuffled[b * count + n] = bytes[n * sizeof(T) + b];
+
+    uLongf size = compressBound(shuffled.size());
+    out.resize(size);
+
+    if (compress2(reinterpret_cast<Bytef *>(out.data()), &size,
+                  reinterpret_cast<const Bytef *>(shuffled.data()),
+                  shuffled.size(), hdf5_deflate_level) != Z_OK)
+      throw std::runtime_error("Failed to compress HDF5 chunk");
+
+    out.resize(size);
+  };
+
+  // chunks are filtered in rounds, and every round is written in order
+  num_threads = std::max(1u, num_threads);
+  const hsize_t round = 4 * num_threads;
+
+  std::vector<std::vector<char>> filtered(round);
+
+  // the first error of a worker, which stops the others at their next chunk
+  std::exception_ptr error;
+  std::mutex error_mutex;
+
+  for (hsize_t first_chunk = 0; first_chunk < num_chunks;
+       first_chunk += round) {
+    const hsize_t end_chunk = std::min(first_chunk + round, num_chunks);
+    std::atomic<hsize_t> next_chunk(first_chunk);
+
+    auto worker = [&]() {
+      try {
+        std::vector<T> values(chunk_values);
+        std::vector<char> shuffled;
+
+        for (hsize_t c; (c = next_chunk++) < end_chunk;) {
+          // chunks are stored whole, the part past the last point is zero
+          std::fill(values.begin(), values.end(), T(0));
+
+          const int64_t begin = c * hdf5_chunk_points;
+          const int64_t end =
+              std::min<int64_t>(begin + hdf5_chunk_points, num_points);
+
+          // the seed of the first point of the chunk
+          unsigned int seed =
+              std::upper_bound(offsets.begin(), offsets.end(), begin) -
+              offsets.begin() - 1;
+
+          for (int64_t point = begin; point < end; ++point) {
+            while (point >= offsets[seed + 1])
+              ++seed;
+
+            gather(seed, point - offsets[seed],
+                   &values[(point - begin) * components]);
+          }
+
+          filter(values, filtered[c - first_chunk], shuffled);
+        }
+      } catch (...) {
+        std::lock_guard<std::mutex> lock(error_mutex);
+        if (!error)
+          error = std::current_exception();
+        next_chunk = end_chunk;
+      }
+    };
+
+    std::vector<std::thread> threads;
+    for (unsigned int n = 1; n < num_threads; ++n)
+      threads.emplace_back(worker);
+
+    worker();
+
+    for (auto &thread : threads)
+      thread.join();
+
+    for (hsize_t c = first_chunk; c < end_chunk && !error; ++c) {
+      const hsize_t offset[2] = {c * hdf5_chunk_points, 0};
+      const std::vector<char> &data = filtered[c - first_chunk];
+
+      // a filter mask of 0: all filters of the pipeline were applied
+      if (H5Dwrite_chunk(dset, H5P_DEFAULT, 0, offset, data.size(),
+                         data.data()) < 0)
+        error = std::make_exception_ptr(
+            std::runtime_error("Failed to write HDF5 chunk"));
+    }
+
+    if (error) {
+      H5Dclose(dset);
+      std::rethrow_exception(error);
+    }
+  }
+
+  H5Dclose(dset);
+}
+
+/// write the index of the trajectories, see save_as_hdf5()
+inline void write_trajectory_offsets(hid_t file,
+                                     const std::vector<int64_t> &offsets) {
+  const hsize_t num_offsets = offsets.size();
+  hid_t space = H5Screate_simple(1, &num_offsets, nullptr);
+  hid_t dset = H5Dcreate(file, "/offsets", H5T_NATIVE_INT64, space,
+                         H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
+  const herr_t status =
+      dset < 0 ? -1
+               : H5Dwrite(dset, H5T_NATIVE_INT64, H5S_ALL, H5S_ALL,
+                          H5P_DEFAULT, offsets.data());
+
+  if (dset >= 0)
+    H5Dclose(dset);
+  H5Sclose(space);
+
+  if (status < 0)
+    throw std::runtime_error("Failed to write HDF5 offsets");
+}
+
+/// attach count floats to object as the attribute name
+inline void write_attribute(hid_t object, const char *name,
+                            const float *values, hsize_t count) {
+  hid_t space = H5Screate_simple(1, &count, nullptr);
+  hid_t attribute = H5Acreate(object, name, H5T_NATIVE_FLOAT, space,
+                              H5P_DEFAULT, H5P_DEFAULT);
+  const herr_t status =
+      attribute < 0 ? -1 : H5Awrite(attribute, H5T_NATIVE_FLOAT, values);
+
+  if (attribute >= 0)
+    H5Aclose(attribute);
+  H5Sclose(space);
+
+  if (status < 0)
+    throw std::runtime_error("Failed to write HDF5 attribute");
+}
+
+// -------------------------------------------------------------------------
+
+/// write the packed trajectories to an HDF5 file, one seed after the
+/// other. /positions (points x 3) and /time (points) hold the points of
+/// seed i at [offsets[i], offsets[i + 1]) of /offsets, so that one
+/// trajectory is read with a single hyperslab. See
+/// write_trajectory_dataset() for the storage of the points. hdf5_mutex is
+/// held throughout, as the prefetch of a time series may still be reading.
+inline void save_as_hdf5(const packed_trajectories &lines,
+                         const std::string &filename,
+                         unsigned int num_threads =
+                             std::thread::hardware_concurrency()) {
+  const std::vector<int64_t> &offsets = lines.offsets;
+
+  std::lock_guard<std::mutex> lock(hdf5_mutex);
+
+  hid_t file =
+      H5Fcreate(filename.c_str(), H5F_ACC_TRUNC, H5P_DEFAULT, H5P_DEFAULT);
+  if (file < 0)
+    throw std::runtime_error("Failed to create HDF5 file");
+
+  try {
+    write_trajectory_dataset<float>(
+        file, "/positions", H5T_NATIVE_FLOAT, 3, offsets, num_threads,
+        [&](unsigned int seed, unsigned int step, float *values) {
+          const float *p = &lines.positions[(offsets[seed] + step) * 3];
+          values[0] = p[0];
+          values[1] = p[1];
+          values[2] = p[2];
+        });
+
+    write_trajectory_dataset<float>(
+        file, "/time", H5T_NATIVE_FLOAT, 1, offsets, num_threads,
+        [&](unsigned int seed, unsigned int step, float *values) {
+          values[0] = lines.times[offsets[seed] + step];
+        });
+
+    write_trajectory_offsets(file, offsets);
+  } catch (...) {
+    H5Fclose(file);
+    throw;
+  }
+
+  H5Fclose(file);
+
+  std::cerr << "wrote " << lines.num_seeds() << " trajectories ("
+            << lines.num_points() << " points) to " << filename << '\n';
+}
+
+/// write the trajectories encoded by output to an HDF5 file laid out like
+/// that of save_as_hdf5(), but without /time: step k of a seed is at time
+/// k dt. /deltas (points x 3, int16) holds the differences of the position
+/// codes of consecutive steps; the code of a step is the sum of the
+/// differences of the seed up to it, modulo 2^16, and its position is
+/// lower + code * cell with the attributes lower, cell and dt of the file.
+/// A position is thus off by at most cell / 2 per coordinate. hdf5_mutex is
+/// held throughout, like in save_as_hdf5().
+inline void save_as_quantized_hdf5(const quantized_trajectories &output,
+                                   float dt, const std::string &filename,
+                                   unsigned int num_threads =
+                                       std::thread::hardware_concurrency()) {
+  const unsigned int num_seeds = output.num_seeds();
+  const quantized_columns &codes = output.codes();
+  const std::vector<unsigned int> lengths = output.lengths();
+
+  std::vector<int64_t> offsets(num_seeds + 1, 0);
+  for (unsigned int seed = 0; seed < num_seeds; ++seed)
+    offsets[seed + 1] = offsets[seed] + lengths[seed];
+
+  std::lock_guard<std::mutex> lock(hdf5_mutex);
+
+  hid_t file =
+      H5Fcreate(filename.c_str(), H5F_ACC_TRUNC, H5P_DEFAULT, H5P_DEFAULT);
+  if (file < 0)
+    throw std::runtime_error("Failed to create HDF5 file");
+
+  const position_quantizer &quantizer = output.quantizer();
+  const float lower[3] = {quantizer.lower.x(), quantizer.lower.y(),
+                          quantizer.lower.z()};
+  const float cell[3] = {quantizer.cell.x(), quantizer.cell.y(),
+                         quantizer.cell.z()};
+
+  try {
+    write_trajectory_dataset<int16_t>(
+        file, "/deltas", H5T_NATIVE_INT16, 3, offsets, num_threads,
+        [&](unsigned int seed, unsigned int step, int16_t *values) {
+          for (unsigned int c = 0; c < 3; ++c)
+            values[c] = static_cast<int16_t>(codes.column(step, c)[seed]);
+        });
+
+    write_trajectory_offsets(file, offsets);
+
+    write_attribute(file, "lower", lower, 3);
+    write_attribute(file, "cell", cell, 3);
+    write_attribute(file, "dt", &dt, 1);
+  } catch (...) {
+    H5Fclose(file);
+    throw;
+  }
+
+  H5Fclose(file);
+
+  const sycl::float3 error = quantizer.max_error();
+  std::cerr << "wrote " << num_seeds << " quantized trajectories ("
+            << offsets.back() << " points) to " << filename
+            << ", max error (" << error.x() << ", " << error.y() << ", "
+            << error.z() << ")\n";
+}
+
+// -------------------------------------------------------------------------
+
+/// write the packed trajectories in the given format, to test.h5 or to
+/// test.vtp
+inline void save_trajectories(const packed_trajectories &lines,
+                              output_format format) {
+  if (format == output_format::hdf5)
+    save_as_hdf5(lines, "test.h5");
+  else
+    save_as_vtk(lines, "test.vtp", format);
+}
+
+/// the same for the trajectories of houtput up to num_steps, packed on the
+/// host
+inline void save_trajectories(const particle_columns &houtput,
+                              unsigned int num_steps, output_format format) {
+  save_trajectories(pack_trajectories(houtput, num_steps), format);
+}
+
+#endif // __hdf5_output_hpp
@@ -0,0 +1,292 @@
+#ifndef __integrators_simd_hpp
+#define __integrators_simd_hpp
+
+#include "hdf5_field_sycl.h"
+#include "integrators_sycl.h"
+#include "particles_sycl.h"
+
+#include <CL/sycl.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <experimental/simd>
+#include <thread>
+#include <vector>
+
+namespace sycl = cl::sycl;
+namespace stdx = std::experimental;
+
+// -------------------------------------------------------------------------
+// Host backend: the particles are integrated by host threads in groups of
+// float_v::size() lanes, one particle per lane, with explicit SIMD
+// arithmetic and gathers from a host copy of the field. The lane count is
+// the native vector width of the target, e.g. 8 with AVX2 and 16 with
+// AVX-512 builds.
+
+using float_v = stdx::native_simd<float>;
+using int_v = stdx::rebind_simd_t<int, float_v>;
+
+/// float3 of SIMD lanes, with the operators used by the integrators
+struct float3_v {
+  float_v x, y, z;
+
+  float3_v() = default;
+  explicit float3_v(float s) : x(s), y(s), z(s) {}
+  float3_v(const float_v &x, const float_v &y, const float_v &z)
+      : x(x), y(y), z(z) {}
+
+  friend float3_v operator+(const float3_v &a, const float3_v &b) {
+    return {a.x + b.x, a.y + b.y, a.z + b.z};
+  }
+
+  friend float3_v operator-(const float3_v &a, const float3_v &b) {
+    return {a.x - b.x, a.y - b.y, a.z - b.z};
+  }
+
+  friend float3_v operator*(const float_v &s, const float3_v &a) {
+    return {s * a.x, s * a.y, s * a.z};
+  }
+
+  friend float3_v operator*(float s, const float3_v &a) {
+    return float_v(s) * a;
+  }
+};
+
+// -------------------------------------------------------------------------
+
+/// host copy of a steady field for the SIMD backend: the decoded voxels as
+/// three linear float planes and the cell mask
+class simd_field {
+public:
+  /// copy the voxels and the mask of field back from the device
+  template <typename Voxel>
+  simd_field(sycl::queue &q, const hdf5_field<Voxel> &field)
+      : m_offset(field.offset()), m_scale(field.scale()) {
+    const array3D<Voxel> &array = field.array();
+
+    m_nx = array.nx();
+    m_ny = array.ny();
+    m_nz = array.nz();
+
+    std::vector<Voxel> voxels(array.size());
+    m_mask.resize(array.mask_size());
+
+    q.memcpy(voxels.data(), array.data(), voxels.size() * sizeof(Voxel));
+    q.memcpy(m_mask.data(), array.mask(), m_mask.size() * sizeof(uint32_t));
+    q.wait();
+
+    // decode once and undo the layout of the array
+    const size_t total = size_t(m_nx) * m_ny * m_nz;
+    m_x.resize(total);
+    m_y.resize(total);
+    m_z.resize(total);
+
+    size_t n = 0;
+    for (int k = 0; k < m_nz; ++k)
+      for (int j = 0; j < m_ny; ++j)
+        for (int i = 0; i < m_nx; ++i, ++n) {
+          const sycl::float3 v = array.decode(voxels[array.index(i, j, k)]);
+          m_x[n] = v.x();
+          m_y[n] = v.y();
+          m_z[n] = v.z();
+        }
+  }
+
+  /// interpolate the field at the positions of all lanes; returns the
+  /// lanes whose position lies in a valid cell, see array3D::sample
+  float_v::mask_type get(const float3_v &pos, float3_v &result) const {
+    float_v gx = (pos.x - m_offset.x()) * m_scale.x();
+    float_v gy = (pos.y - m_offset.y()) * m_scale.y();
+    float_v gz = (pos.z - m_offset.z()) * m_scale.z();
+
+    // also rejects NaN coordinates
+    const float_v::mask_type inside =
+        gx >= 0.0f && gy >= 0.0f && gz >= 0.0f && gx <= float(m_nx - 1) &&
+        gy <= float(m_ny - 1) && gz <= float(m_nz - 1);
+
+    // lanes outside sample the first cell, so that all gathers stay in
+    // the grid
+    where(!inside, gx) = 0.0f;
+    where(!inside, gy) = 0.0f;
+    where(!inside, gz) = 0.0f;
+
+    auto cell_index = [](const float_v &g, int n) {
+      return stdx::min(stdx::static_simd_cast<int_v>(g), int_v(n - 2));
+    };
+
+    const int_v i = cell_index(gx, m_nx);
+    const int_v j = cell_index(gy, m_ny);
+    const int_v k = cell_index(gz, m_nz);
+
+    const int_v cell = (k * (m_ny - 1) + j) * (m_nx - 1) + i;
+    const float_v bit([&](auto l) {
+      return float((m_mask[cell[l] >> 5] >> (cell[l] & 31)) & 1u);
+    });
+
+    const int_v base = (k * m_ny + j) * m_nx + i;
+    const int sy = m_nx;
+    const int sz = m_nx * m_ny;
+    const int corner[8] = {0, 1, sy, sy + 1, sz, sz + 1, sz + sy, sz + sy + 1};
+
+    float3_v v[8];
+    for (int d = 0; d < 8; ++d) {
+      const int_v idx = base + corner[d];
+      v[d] = {gather(m_x, idx), gather(m_y, idx), gather(m_z, idx)};
+    }
+
+    const float_v fx = gx - stdx::static_simd_cast<float_v>(i);
+    const float_v fy = gy - stdx::static_simd_cast<float_v>(j);
+    const float_v fz = gz - stdx::static_simd_cast<float_v>(k);
+
+    // the lerps of array3D::interpolate
+    const float3_v v00 = v[0] + fx * (v[1] - v[0]);
+    const float3_v v10 = v[2] + fx * (v[3] - v[2]);
+    const float3_v v01 = v[4] + fx * (v[5] - v[4]);
+    const float3_v v11 = v[6] + fx * (v[7] - v[6]);
+    const float3_v v0 = v00 + fy * (v10 - v00);
+    const float3_v v1 = v01 + fy * (v11 - v01);
+
+    result = v0 + fz * (v1 - v0);
+
+    return inside && bit != 0.0f;
+  }
+
+private:
+  static float_v gather(const std::vector<float> &plane, const int_v &idx) {
+    return float_v([&](auto l) { return plane[idx[l]]; });
+  }
+
+  int m_nx = 0, m_ny = 0, m_nz = 0;
+  std::vector<float> m_x, m_y, m_z;
+  std::vector<uint32_t> m_mask;
+  sycl::float3 m_offset;
+  sycl::float3 m_scale;
+};
+
+// -------------------------------------------------------------------------
+
+/// one step of the fixed step scheme of Tableau for all lanes, with the
+/// arithmetic of integrator_erk::step. Lanes whose samples leave the valid
+/// cells get a NaN time and keep their position.
+template <typename Tableau> struct integrator_simd {
+  float3_v p; // positions
+  float_v t;  // times
+
+  void step(const simd_field &field, const float dt) {
+    float3_v k[Tableau::stages];
+
+    const float_v::mask_type valid =
+        !stdx::isnan(t) && stages<0>(field, dt, k);
+    const float3_v next =
+        p + dt * weighted_sum<solution_weights<Tableau>, Tableau::stages>(k);
+
+    where(valid, p.x) = next.x;
+    where(valid, p.y) = next.y;
+    where(valid, p.z) = next.z;
+    where(valid, t) += dt;
+    where(!valid, t) = NAN;
+  }
+
+private:
+  /// evaluate stages S, S+1, ...; the lanes whose samples all were valid
+  template <int S>
+  float_v::mask_type stages(const simd_field &field, const float dt,
+                            float3_v *k) const {
+    if constexpr (S == Tableau::stages) {
+      return float_v::mask_type(true);
+    } else {
+      const float3_v dp = weighted_sum<stage_weights<Tableau, S>, S>(k);
+
+      const float_v::mask_type valid = field.get(p + dt * dp, k[S]);
+
+      return valid && stages<S + 1>(field, dt, k);
+    }
+  }
+};
+
+// -------------------------------------------------------------------------
+
+/// integrate the seeds stored in step 0 of output over num_steps - 1 steps
+/// of the fixed step scheme of Tableau, on num_threads host threads. Every
+/// thread takes chunks of lane groups and keeps each group in registers
+/// for all steps.
+template <typename Tableau>
+void integrate_simd(const simd_field &field, const particle_columns &output,
+                    unsigned int num_steps, float dt,
+                    unsigned int num_threads) {
+  constexpr unsigned int lanes = float_v::size();
+  // lane groups taken by a thread at a time
+  constexpr unsigned int chunk = 16;
+
+  const unsigned int num_seeds = output.num_seeds;
+  const unsigned int num_groups = (num_seeds + lanes - 1) / lanes;
+
+  std::atomic<unsigned int> next_group(0);
+
+  auto load = [&](const float *column, unsigned int first) {
+    if (first + lanes <= num_seeds)
+      return float_v(column + first, stdx::element_aligned);
+
+    return float_v([&](auto l) {
+      return first + l < num_seeds ? column[first + l] : float(NAN);
+    });
+  };
+
+  auto store = [&](const float_v &v, float *column, unsigned int first) {
+    if (first + lanes <= num_seeds) {
+      v.copy_to(column + first, stdx::element_aligned);
+      return;
+    }
+
+    for (unsigned int l = 0; first + l < num_seeds; ++l)
+      column[first + l] = v[l];
+  };
+
+  auto worker = [&]() {
+    for (;;) {
+      const unsigned int begin = next_group.fetch_add(chunk);
+
+      if (begin >= num_groups)
+        return;
+
+      for (unsigned int g = begin; g < std::min(begin + chunk, num_groups);
+           ++g) {
+        const unsigned int first = g * lanes;
+
+        // lanes past the last seed start with a NaN time and stay idle
+        integrator_simd<Tableau> intg;
+        intg.p = {load(output.column(0, 0), first),
+                  load(output.column(0, 1), first),
+                  load(output.column(0, 2), first)};
+        intg.t = load(output.column(0, 3), first);
+
+        unsigned int s = 1;
+        for (; s < num_steps && stdx::any_of(!stdx::isnan(intg.t)); ++s) {
+          intg.step(field, dt);
+
+          store(intg.p.x, output.column(s, 0), first);
+          store(intg.p.y, output.column(s, 1), first);
+          store(intg.p.z, output.column(s, 2), first);
+          store(intg.t, output.column(s, 3), first);
+        }
+
+        // the whole group terminated early
+        for (; s < num_steps; ++s)
+          store(float_v(NAN), output.column(s, 3), first);
+      }
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for (unsigned int n = 1; n < num_threads; ++n)
+    threads.emplace_back(worker);
+
+  worker();
+
+  for (auto &thread : threads)
+    thread.join();
+}
+
+#endif // __integrators_simd_hpp
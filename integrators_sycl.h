@@ -0,0 +1,282 @@
+#ifndef __integrators_sycl_hpp
+#define __integrators_sycl_hpp
+
+#include <CL/sycl.hpp>
+#include <cmath>
+#include <cstdio>
+#include <iostream>
+#include <string>
+
+namespace sycl = cl::sycl;
+
+// -------------------------------------------------------------------------
+// Butcher tableaus of explicit Runge-Kutta schemes. a is the strictly lower
+// triangular stage matrix, b the weights of the solution and c the stage
+// times. Embedded schemes also provide e = b - b*, the weights of the error
+// estimate, and the order of the lower order solution.
+
+struct tableau_euler {
+  static constexpr int stages = 1;
+  static constexpr float a[1][1] = {{0.0f}};
+  static constexpr float b[1] = {1.0f};
+  static constexpr float c[1] = {0.0f};
+};
+
+struct tableau_heun {
+  static constexpr int stages = 2;
+  static constexpr float a[2][2] = {{0.0f, 0.0f}, {1.0f, 0.0f}};
+  static constexpr float b[2] = {0.5f, 0.5f};
+  static constexpr float c[2] = {0.0f, 1.0f};
+};
+
+struct tableau_rk4 {
+  static constexpr int stages = 4;
+  static constexpr float a[4][4] = {{0.0f, 0.0f, 0.0f, 0.0f},
+                                    {0.5f, 0.0f, 0.0f, 0.0f},
+                                    {0.0f, 0.5f, 0.0f, 0.0f},
+                                    {0.0f, 0.0f, 1.0f, 0.0f}};
+  static constexpr float b[4] = {1.0f / 6.0f, 1.0f / 3.0f, 1.0f / 3.0f,
+                                 1.0f / 6.0f};
+  static constexpr float c[4] = {0.0f, 0.5f, 0.5f, 1.0f};
+};
+
+/// Dormand-Prince 5(4); the last stage is evaluated at the new position
+struct tableau_dopri5 {
+  static constexpr int stages = 7;
+  static constexpr int order = 4;
+  static constexpr float a[7][7] = {
+      {0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f},
+      {1.0f / 5.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f},
+      {3.0f / 40.0f, 9.0f / 40.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f},
+      {44.0f / 45.0f, -56.0f / 15.0f, 32.0f / 9.0f, 0.0f, 0.0f, 0.0f, 0.0f},
+      {19372.0f / 6561.0f, -25360.0f / 2187.0f, 64448.0f / 6561.0f,
+       -212.0f / 729.0f, 0.0f, 0.0f, 0.0f},
+      {9017.0f / 3168.0f, -355.0f / 33.0f, 46732.0f / 5247.0f, 49.0f / 176.0f,
+       -5103.0f / 18656.0f, 0.0f, 0.0f},
+      {35.0f / 384.0f, 0.0f, 500.0f / 1113.0f, 125.0f / 192.0f,
+       -2187.0f / 6784.0f, 11.0f / 84.0f, 0.0f}};
+  static constexpr float b[7] = {35.0f / 384.0f,     0.0f,
+                                 500.0f / 1113.0f,   125.0f / 192.0f,
+                                 -2187.0f / 6784.0f, 11.0f / 84.0f,
+                                 0.0f};
+  static constexpr float c[7] = {0.0f, 1.0f / 5.0f, 3.0f / 10.0f, 4.0f / 5.0f,
+                                 8.0f / 9.0f, 1.0f, 1.0f};
+  static constexpr float e[7] = {71.0f / 57600.0f,     0.0f,
+                                 -71.0f / 16695.0f,    71.0f / 1920.0f,
+                                 -17253.0f / 339200.0f, 22.0f / 525.0f,
+                                 -1.0f / 40.0f};
+};
+
+// -------------------------------------------------------------------------
+
+/// coefficient rows of a tableau, as accepted by weighted_sum
+template <typename Tableau, int S> struct stage_weights {
+  static constexpr float w(int j) { return Tableau::a[S][j]; }
+};
+
+template <typename Tableau> struct solution_weights {
+  static constexpr float w(int j) { return Tableau::b[j]; }
+};
+
+template <typename Tableau> struct error_weights {
+  static constexpr float w(int j) { return Tableau::e[j]; }
+};
+
+/// sum of w(j) * k[j] for j < N, unrolled at compile time; zero weights of
+/// the tableau do not generate any code. V is sycl::float3 or any vector
+/// type constructible from a scalar, like the lanes of the SIMD backend.
+template <typename Weights, int N, int J = 0, typename V>
+inline V weighted_sum(const V *k) {
+  if constexpr (J == N) {
+    return V(0.0f);
+  } else if constexpr (Weights::w(J) == 0.0f) {
+    return weighted_sum<Weights, N, J + 1>(k);
+  } else {
+    constexpr float w = Weights::w(J);
+    return w * k[J] + weighted_sum<Weights, N, J + 1>(k);
+  }
+}
+
+// -------------------------------------------------------------------------
+
+/// fixed step explicit Runge-Kutta integrator described by a Butcher
+/// tableau. Fields are sampled at the stage times, so time-varying fields
+/// give pathlines.
+template <typename Tableau> struct integrator_erk {
+  sycl::float3 p; // position
+  float t;        // time
+
+  template <typename Field> void step(const Field &field, const float dt) {
+    if (sycl::isnan(t))
+      return;
+
+    sycl::float3 k[Tableau::stages];
+
+    if (!stages<0>(field, dt, k)) {
+      printf("Out of bounds at (%.3f, %.3f, %.3f)\n", p.x(), p.y(), p.z());
+      t = NAN;
+      return;
+    }
+
+    p += dt * weighted_sum<solution_weights<Tableau>, Tableau::stages>(k);
+    t += dt;
+  }
+
+private:
+  /// evaluate stages S, S+1, ...; false if a sample left the domain
+  template <int S, typename Field>
+  bool stages(const Field &field, const float dt, sycl::float3 *k) const {
+    if constexpr (S == Tableau::stages) {
+      return true;
+    } else {
+      const sycl::float3 dp = weighted_sum<stage_weights<Tableau, S>, S>(k);
+      constexpr float c = Tableau::c[S];
+
+      if (!field.get(p + dt * dp, t + c * dt, k[S]))
+        return false;
+
+      return stages<S + 1>(field, dt, k);
+    }
+  }
+};
+
+// -------------------------------------------------------------------------
+
+/// embedded explicit Runge-Kutta integrator with per-particle step size
+/// control; every call to step() advances the particle by one accepted step
+template <typename Tableau> struct integrator_erk_adaptive {
+  sycl::float3 p;        // position
+  float t;               // time
+  float h;               // current step size
+  float tol;             // tolerated local error per step
+  unsigned int accepted; // number of accepted steps
+  unsigned int rejected; // number of rejected steps
+
+  template <typename Field> void step(const Field &field, const float dt) {
+    if (sycl::isnan(t))
+      return;
+
+    // give up on error control after this many consecutive rejections
+    const unsigned int max_attempts = 16;
+
+    if (!(h > 0.0f))
+      h = dt;
+
+    sycl::float3 k[Tableau::stages];
+
+    // the first stage does not depend on h and is shared by all attempts
+    if (!field.get(p, t, k[0]))
+      goto outside;
+
+    for (unsigned int attempt = 0; attempt < max_attempts; ++attempt) {
+      if (!stages<1>(field, k))
+        goto outside;
+
+      // difference between the solution and the embedded lower order one
+      const sycl::float3 e =
+          h * weighted_sum<error_weights<Tableau>, Tableau::stages>(k);
+
+      const float err = sycl::length(e) / tol;
+
+      // step size controller, with safety factor and bounded growth
+      const float exponent = -1.0f / (Tableau::order + 1);
+      const float factor =
+          err > 0.0f ? sycl::clamp(0.9f * sycl::pow(err, exponent), 0.2f, 5.0f)
+                     : 5.0f;
+
+      if (err <= 1.0f || attempt + 1 == max_attempts) {
+        p += h * weighted_sum<solution_weights<Tableau>, Tableau::stages>(k);
+        t += h;
+        h *= factor;
+        ++accepted;
+        return;
+      }
+
+      h *= factor;
+      ++rejected;
+    }
+
+    return;
+
+  outside:
+    printf("Out of bounds at (%.3f, %.3f, %.3f)\n", p.x(), p.y(), p.z());
+    t = NAN;
+  }
+
+private:
+  template <int S, typename Field>
+  bool stages(const Field &field, sycl::float3 *k) const {
+    if constexpr (S == Tableau::stages) {
+      return true;
+    } else {
+      const sycl::float3 dp = weighted_sum<stage_weights<Tableau, S>, S>(k);
+      constexpr float c = Tableau::c[S];
+
+      if (!field.get(p + h * dp, t + c * h, k[S]))
+        return false;
+
+      return stages<S + 1>(field, k);
+    }
+  }
+};
+
+// -------------------------------------------------------------------------
+
+using integrator_euler = integrator_erk<tableau_euler>;
+using integrator_heun = integrator_erk<tableau_heun>;
+using integrator_rk4 = integrator_erk<tableau_rk4>;
+using integrator_rk45 = integrator_erk_adaptive<tableau_dopri5>;
+
+// -------------------------------------------------------------------------
+
+/// print accepted/rejected step counts of an adaptive integrator
+template <typename Tableau>
+void print_statistics(const integrator_erk_adaptive<Tableau> *states,
+                      unsigned int num_seeds) {
+  unsigned long accepted = 0, rejected = 0;
+
+  for (unsigned int i = 0; i < num_seeds; ++i) {
+    accepted += states[i].accepted;
+    rejected += states[i].rejected;
+  }
+
+  // one lookup for the shared first stage plus the others per attempt
+  const unsigned long lookups =
+      accepted + (Tableau::stages - 1) * (accepted + rejected);
+
+  std::cerr << "adaptive: " << accepted << " accepted steps, " << rejected
+            << " rejected steps, " << lookups << " field lookups ("
+            << (accepted ? double(lookups) / accepted : 0.0)
+            << " per accepted step)\n";
+}
+
+/// fixed step integrators have no statistics to report
+template <typename Tableau>
+void print_statistics(const integrator_erk<Tableau> *, unsigned int) {}
+
+// -------------------------------------------------------------------------
+
+/// translate the scheme name given on the command line into an integrator
+/// type: f is called with the initial state of every seed. Returns false
+/// for an unknown scheme name.
+template <typename F>
+bool dispatch_integrator(const std::string &scheme, float dt, float tol, F f) {
+  if (scheme == "euler") {
+    f(integrator_euler{});
+  } else if (scheme == "heun") {
+    f(integrator_heun{});
+  } else if (scheme == "rk4") {
+    f(integrator_rk4{});
+  } else if (scheme == "rk45") {
+    integrator_rk45 seed_state = {};
+    seed_state.h = dt;
+    seed_state.tol = tol;
+    f(seed_state);
+  } else {
+    return false;
+  }
+
+  return true;
+}
+
+#endif // __integrators_sycl_hpp
@@ -0,0 +1,125 @@
+#ifndef __pack_sycl_hpp
+#define __pack_sycl_hpp
+
+#include "particles_sycl.h"
+#include "scan_sycl.h"
+
+#include <CL/sycl.hpp>
+#include <cstdint>
+
+namespace sycl = cl::sycl;
+
+// -------------------------------------------------------------------------
+
+/// trajectory output that keeps all steps in device memory. pack() packs
+/// the valid points of every seed into one seed-major array on the device,
+/// so that only those points are copied to the host, already in the order
+/// of the files: the length of every trajectory is counted up to its first
+/// NaN time, the offsets are the exclusive scan of the lengths, and every
+/// point is scattered to its offset.
+class device_trajectories {
+public:
+  device_trajectories(sycl::queue &q, unsigned int num_seeds,
+                      unsigned int num_steps)
+      : m_q(q), m_scan(q, num_seeds) {
+    m_columns = {sycl::malloc_device<float>(
+                     particle_columns::size(num_steps, num_seeds), q),
+                 num_seeds};
+  }
+
+  ~device_trajectories() {
+    m_q.wait();
+    sycl::free(m_columns.data, m_q);
+  }
+
+  device_trajectories(const device_trajectories &) = delete;
+  device_trajectories &operator=(const device_trajectories &) = delete;
+
+  /// bytes of device memory needed for num_steps steps, at most, including
+  /// the packed points
+  static size_t device_size(unsigned int num_steps, unsigned int num_seeds) {
+    return 2 * sizeof(float) * particle_columns::size(num_steps, num_seeds) +
+           2 * sizeof(int64_t) * num_seeds;
+  }
+
+  unsigned int num_seeds() const { return m_columns.num_seeds; }
+
+  /// copy the steps [step, step + num_steps) from the device columns
+  /// trajectory once computed is complete; see host_trajectories::copy()
+  sycl::event copy(sycl::queue &q, const particle_columns &trajectory,
+                   unsigned int step, unsigned int num_steps,
+                   sycl::event computed) const {
+    const particle_columns batch = m_columns.from(step);
+
+    return q.submit([&](sycl::handler &h) {
+      h.depends_on(computed);
+      h.memcpy(batch.data, trajectory.data,
+               sizeof(float) * particle_columns::size(num_steps,
+                                                      m_columns.num_seeds));
+    });
+  }
+
+  /// pack the steps [0, num_steps) and copy them to the host
+  packed_trajectories pack(unsigned int num_steps) {
+    const particle_columns columns = m_columns;
+    const unsigned int n = columns.num_seeds;
+
+    int64_t *lengths = sycl::malloc_device<int64_t>(n, m_q);
+    int64_t *offsets = sycl::malloc_device<int64_t>(n, m_q);
+
+    m_q.parallel_for(sycl::range<1>(n), [=](sycl::id<1> i) {
+         unsigned int length = 0;
+         while (length < num_steps && !sycl::isnan(columns.time(length, i)))
+           ++length;
+
+         lengths[i] = length;
+       }).wait();
+
+    const int64_t num_points = m_scan.exclusive_scan(lengths, offsets, n);
+
+    packed_trajectories packed;
+    packed.offsets.resize(n + 1);
+    packed.offsets[n] = num_points;
+    packed.positions.resize(num_points * 3);
+    packed.times.resize(num_points);
+
+    float *positions = sycl::malloc_device<float>(num_points * 3, m_q);
+    float *times = sycl::malloc_device<float>(num_points, m_q);
+
+    // a work item per step and seed, so that the columns are read in order
+    const size_t num_items = size_t(num_steps) * n;
+
+    m_q.parallel_for(sycl::range<1>(num_items), [=](sycl::id<1> id) {
+         const unsigned int step = id[0] / n, i = id[0] % n;
+
+         if (int64_t(step) >= lengths[i])
+           return;
+
+         const int64_t point = offsets[i] + step;
+         for (unsigned int c = 0; c < 3; ++c)
+           positions[point * 3 + c] = columns.column(step, c)[i];
+         times[point] = columns.time(step, i);
+       }).wait();
+
+    m_q.memcpy(packed.offsets.data(), offsets, sizeof(int64_t) * n);
+    m_q.memcpy(packed.positions.data(), positions,
+               sizeof(float) * packed.positions.size());
+    m_q.memcpy(packed.times.data(), times,
+               sizeof(float) * packed.times.size());
+    m_q.wait();
+
+    sycl::free(times, m_q);
+    sycl::free(positions, m_q);
+    sycl::free(offsets, m_q);
+    sycl::free(lengths, m_q);
+
+    return packed;
+  }
+
+private:
+  sycl::queue &m_q;
+  device_scan m_scan;
+  particle_columns m_columns; // device memory, all steps
+};
+
+#endif // __pack_sycl_hpp
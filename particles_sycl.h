@@ -0,0 +1,323 @@
+#ifndef __particles_sycl_hpp
+#define __particles_sycl_hpp
+
+#include <CL/sycl.hpp>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace sycl = cl::sycl;
+
+// -------------------------------------------------------------------------
+
+/// structure-of-arrays positions and times of num_seeds particles over a
+/// number of steps. Every step is stored as four consecutive columns x, y, z
+/// and t of num_seeds floats each: a work item per particle writes
+/// coalesced, there is no float3 padding, and consecutive steps form one
+/// contiguous block that can be copied at once.
+struct particle_columns {
+  float *data = nullptr;
+  unsigned int num_seeds = 0;
+
+  /// number of floats needed to store num_steps steps
+  static size_t size(unsigned int num_steps, unsigned int num_seeds) {
+    return size_t(num_steps) * 4 * num_seeds;
+  }
+
+  /// column c (0: x, 1: y, 2: z, 3: t) of the given step
+  float *column(unsigned int step, unsigned int c) const {
+    return data + (size_t(step) * 4 + c) * num_seeds;
+  }
+
+  /// the columns starting at the given step
+  particle_columns from(unsigned int step) const {
+    return {column(step, 0), num_seeds};
+  }
+
+  void store(unsigned int step, unsigned int i, const sycl::float3 &p,
+             float t) const {
+    column(step, 0)[i] = p.x();
+    column(step, 1)[i] = p.y();
+    column(step, 2)[i] = p.z();
+    column(step, 3)[i] = t;
+  }
+
+  sycl::float3 position(unsigned int step, unsigned int i) const {
+    return {column(step, 0)[i], column(step, 1)[i], column(step, 2)[i]};
+  }
+
+  float time(unsigned int step, unsigned int i) const {
+    return column(step, 3)[i];
+  }
+};
+
+// -------------------------------------------------------------------------
+
+/// the valid points of all trajectories, one seed after the other: the
+/// points of seed i are [offsets[i], offsets[i + 1]). This is the layout
+/// the trajectory files are written from.
+struct packed_trajectories {
+  std::vector<float> positions; // x, y and z of every point
+  std::vector<float> times;
+  std::vector<int64_t> offsets; // num_seeds() + 1 entries
+
+  unsigned int num_seeds() const { return offsets.size() - 1; }
+  size_t num_points() const { return times.size(); }
+};
+
+/// pack the steps [0, num_steps) of columns on the host; every trajectory
+/// ends at its first NaN time. See device_trajectories for the packing on
+/// the device.
+inline packed_trajectories pack_trajectories(const particle_columns &columns,
+                                             unsigned int num_steps) {
+  const unsigned int num_seeds = columns.num_seeds;
+
+  packed_trajectories packed;
+  packed.offsets.assign(num_seeds + 1, 0);
+
+  for (unsigned int i = 0; i < num_seeds; ++i) {
+    unsigned int length = 0;
+    while (length < num_steps && !std::isnan(columns.time(length, i)))
+      ++length;
+
+    packed.offsets[i + 1] = packed.offsets[i] + length;
+  }
+
+  packed.positions.resize(packed.offsets.back() * 3);
+  packed.times.resize(packed.offsets.back());
+
+  // step by step, so that the columns are read in order
+  for (unsigned int step = 0; step < num_steps; ++step)
+    for (unsigned int i = 0; i < num_seeds; ++i) {
+      const int64_t point = packed.offsets[i] + step;
+
+      if (point >= packed.offsets[i + 1])
+        continue;
+
+      for (unsigned int c = 0; c < 3; ++c)
+        packed.positions[point * 3 + c] = columns.column(step, c)[i];
+      packed.times[point] = columns.time(step, i);
+    }
+
+  return packed;
+}
+
+// -------------------------------------------------------------------------
+
+/// trajectory output that keeps all steps in host memory. The integration
+/// hands every batch of steps to copy() as device columns; see vtp_stream
+/// for an output that writes them to disk instead, device_trajectories for
+/// one that packs them on the device, and quantized_trajectories for one
+/// that encodes them first.
+struct host_trajectories {
+  particle_columns columns;
+
+  unsigned int num_seeds() const { return columns.num_seeds; }
+
+  /// copy the steps [step, step + num_steps) from the device columns
+  /// trajectory once computed is complete; returns the event of the copy,
+  /// after which trajectory may be overwritten
+  sycl::event copy(sycl::queue &q, const particle_columns &trajectory,
+                   unsigned int step, unsigned int num_steps,
+                   sycl::event computed) const {
+    const particle_columns batch = columns.from(step);
+
+    return q.submit([&](sycl::handler &h) {
+      h.depends_on(computed);
+      h.memcpy(batch.data, trajectory.data,
+               sizeof(float) * particle_columns::size(num_steps,
+                                                      columns.num_seeds));
+    });
+  }
+};
+
+// -------------------------------------------------------------------------
+
+/// positions quantized to 16 bits per coordinate: the box from lower to
+/// upper is divided into 65535 intervals along every axis, so a position
+/// inside the box is decoded with an error of at most max_error() per
+/// coordinate, plus the rounding of the decoding in float. Positions outside
+/// the box are clamped to it.
+struct position_quantizer {
+  sycl::float3 lower;
+  sycl::float3 cell; // length of an interval along x, y and z
+
+  position_quantizer(const sycl::float3 &lower, const sycl::float3 &upper)
+      : lower(lower) {
+    for (int c = 0; c < 3; ++c)
+      cell[c] = std::fmax(upper[c] - lower[c], 1e-30f) / 65535.0f;
+  }
+
+  sycl::ushort3 encode(const sycl::float3 &p) const {
+    auto code = [](float x, float lower, float cell) {
+      return static_cast<unsigned short>(
+          sycl::clamp(sycl::rint((x - lower) / cell), 0.0f, 65535.0f));
+    };
+
+    return {code(p.x(), lower.x(), cell.x()),
+            code(p.y(), lower.y(), cell.y()),
+            code(p.z(), lower.z(), cell.z())};
+  }
+
+  sycl::float3 decode(const sycl::ushort3 &code) const {
+    return {lower.x() + code.x() * cell.x(), lower.y() + code.y() * cell.y(),
+            lower.z() + code.z() * cell.z()};
+  }
+
+  sycl::float3 max_error() const { return 0.5f * cell; }
+};
+
+/// 16 bit codes of the positions of num_seeds particles over a number of
+/// steps, stored like particle_columns but with the columns x, y and z only
+struct quantized_columns {
+  uint16_t *data = nullptr;
+  unsigned int num_seeds = 0;
+
+  /// number of codes needed to store num_steps steps
+  static size_t size(unsigned int num_steps, unsigned int num_seeds) {
+    return size_t(num_steps) * 3 * num_seeds;
+  }
+
+  /// column c (0: x, 1: y, 2: z) of the given step
+  uint16_t *column(unsigned int step, unsigned int c) const {
+    return data + (size_t(step) * 3 + c) * num_seeds;
+  }
+};
+
+/// trajectory output of fixed step schemes that keeps compact codes of all
+/// steps in host memory. Before each batch is copied back, a kernel
+/// quantizes its positions with a position_quantizer and replaces every
+/// code by its difference to the code of the previous step of the seed,
+/// modulo 2^16. The time of step k is k dt and is not copied at all, so a
+/// point takes 6 instead of 16 bytes, and the differences along smooth
+/// trajectories are small numbers that compress well. Steps after the
+/// termination of a seed are stored as zero differences.
+class quantized_trajectories {
+public:
+  /// batches have at most max_steps steps
+  quantized_trajectories(sycl::queue &q, unsigned int num_seeds,
+                         unsigned int num_steps, unsigned int max_steps,
+                         const position_quantizer &quantizer)
+      : m_q(q), m_quantizer(quantizer) {
+    m_codes = {sycl::malloc_host<uint16_t>(
+                   quantized_columns::size(num_steps, num_seeds), q),
+               num_seeds};
+
+    for (quantized_columns &encoded : m_encoded)
+      encoded = {sycl::malloc_device<uint16_t>(
+                     quantized_columns::size(max_steps, num_seeds), q),
+                 num_seeds};
+
+    // the codes before the first step are zero
+    m_last = sycl::malloc_device<uint16_t>(size_t(num_seeds) * 3, q);
+    m_length = sycl::malloc_device<unsigned int>(num_seeds, q);
+    q.memset(m_last, 0, sizeof(uint16_t) * num_seeds * 3).wait();
+    q.memset(m_length, 0, sizeof(unsigned int) * num_seeds).wait();
+  }
+
+  ~quantized_trajectories() {
+    m_q.wait();
+    sycl::free(m_length, m_q);
+    sycl::free(m_last, m_q);
+    for (quantized_columns &encoded : m_encoded)
+      sycl::free(encoded.data, m_q);
+    sycl::free(m_codes.data, m_q);
+  }
+
+  quantized_trajectories(const quantized_trajectories &) = delete;
+  quantized_trajectories &operator=(const quantized_trajectories &) = delete;
+
+  unsigned int num_seeds() const { return m_codes.num_seeds; }
+
+  /// encode the steps [step, step + num_steps) of the device columns
+  /// trajectory once computed is complete, and copy the codes; see
+  /// host_trajectories::copy()
+  sycl::event copy(sycl::queue &q, const particle_columns &trajectory,
+                   unsigned int step, unsigned int num_steps,
+                   sycl::event computed) {
+    const unsigned int b = m_batch++ % 2;
+    const quantized_columns encoded = m_encoded[b];
+    const position_quantizer quantizer = m_quantizer;
+    uint16_t *last = m_last;
+    unsigned int *length = m_length;
+    const unsigned int n = m_codes.num_seeds;
+
+    // a seed continues from the codes of the previous batch, and the
+    // buffer must have been copied back
+    m_encoded_event = q.submit([&](sycl::handler &h) {
+      h.depends_on({computed, m_copied[b], m_encoded_event});
+      h.parallel_for(sycl::range<1>(n), [=](sycl::id<1> i) {
+        uint16_t code[3] = {last[i], last[n + i], last[2 * n + i]};
+        unsigned int valid = 0;
+
+        for (unsigned int k = 0; k < num_steps; ++k) {
+          if (sycl::isnan(trajectory.time(k, i))) {
+            for (unsigned int c = 0; c < 3; ++c)
+              encoded.column(k, c)[i] = 0;
+            continue;
+          }
+
+          const sycl::ushort3 next =
+              quantizer.encode(trajectory.position(k, i));
+
+          for (unsigned int c = 0; c < 3; ++c) {
+            encoded.column(k, c)[i] = uint16_t(next[c] - code[c]);
+            code[c] = next[c];
+          }
+          ++valid;
+        }
+
+        for (unsigned int c = 0; c < 3; ++c)
+          last[c * n + i] = code[c];
+        length[i] += valid;
+      });
+    });
+
+    m_copied[b] = q.submit([&](sycl::handler &h) {
+      h.depends_on(m_encoded_event);
+      h.memcpy(m_codes.column(step, 0), encoded.data,
+               sizeof(uint16_t) * quantized_columns::size(num_steps, n));
+    });
+
+    return m_copied[b];
+  }
+
+  /// the differences of the codes of all steps, valid once the copies are
+  /// complete
+  const quantized_columns &codes() const { return m_codes; }
+
+  const position_quantizer &quantizer() const { return m_quantizer; }
+
+  /// the number of steps of every seed up to its termination
+  std::vector<unsigned int> lengths() const {
+    std::vector<unsigned int> result(m_codes.num_seeds);
+    m_q.memcpy(result.data(), m_length,
+               sizeof(unsigned int) * m_codes.num_seeds)
+        .wait();
+    return result;
+  }
+
+private:
+  sycl::queue &m_q;
+  position_quantizer m_quantizer;
+  quantized_columns m_codes;        // host memory, all steps
+  quantized_columns m_encoded[2];   // device memory, one batch each
+  sycl::event m_copied[2];          // the last copy of each batch buffer
+  sycl::event m_encoded_event;      // the last encoding
+  unsigned int m_batch = 0;         // number of encoded batches
+  uint16_t *m_last = nullptr;       // code of the last step of each seed
+  unsigned int *m_length = nullptr; // number of steps of each seed
+};
+
+// -------------------------------------------------------------------------
+
+/// start position of seed i of num_seeds, on a circle in the xz plane
+inline sycl::float3 seed_position(unsigned int i, unsigned int num_seeds) {
+  float radius = 0.1f;
+  float alpha = 2.0f * M_PI * i / num_seeds;
+  return {0.5f + radius * sycl::cos(alpha), 0.01f,
+          0.5f + radius * sycl::sin(alpha)};
+}
+
+#endif // __particles_sycl_hpp
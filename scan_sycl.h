@@ -0,0 +1,115 @@
+#ifndef __scan_sycl_hpp
+#define __scan_sycl_hpp
+
+#include <CL/sycl.hpp>
+#include <cstdint>
+#include <type_traits>
+
+namespace sycl = cl::sycl;
+
+// -------------------------------------------------------------------------
+
+/// device-side exclusive prefix sums and stream compaction over up to
+/// `capacity` elements. The input is split into blocks that are summed by
+/// one work item each; the block sums are scanned in a single task and then
+/// every block is scanned (or scattered) again with its offset.
+class device_scan {
+public:
+  device_scan(sycl::queue &q, size_t capacity) : m_q(q) {
+    m_sums = sycl::malloc_device<uint64_t>(num_blocks(capacity) + 1, m_q);
+    m_total = sycl::malloc_host<uint64_t>(1, m_q);
+  }
+
+  ~device_scan() {
+    sycl::free(m_sums, m_q);
+    sycl::free(m_total, m_q);
+  }
+
+  device_scan(const device_scan &) = delete;
+  device_scan &operator=(const device_scan &) = delete;
+
+  /// out[i] = in[0] + ... + in[i-1]; returns the sum of all n elements.
+  /// in and out may alias.
+  template <typename T> T exclusive_scan(const T *in, T *out, size_t n) {
+    static_assert(std::is_arithmetic<T>::value && sizeof(T) <= sizeof(uint64_t),
+                  "exclusive_scan expects a scalar element type");
+
+    return static_cast<T>(run(
+        n, [=](size_t i) { return static_cast<uint64_t>(in[i]); },
+        [=](size_t i, uint64_t offset) { out[i] = static_cast<T>(offset); }));
+  }
+
+  /// copy the elements of in for which pred holds to out, keeping their
+  /// order; returns the number of copied elements. in and out must not alias.
+  template <typename T, typename Pred>
+  size_t compact(const T *in, T *out, size_t n, Pred pred) {
+    return run(
+        n, [=](size_t i) { return static_cast<uint64_t>(pred(in[i]) ? 1 : 0); },
+        [=](size_t i, uint64_t offset) {
+          if (pred(in[i]))
+            out[offset] = in[i];
+        });
+  }
+
+private:
+  // elements handled sequentially by one work item
+  static constexpr size_t block_size = 1024;
+
+  static size_t num_blocks(size_t n) {
+    return (n + block_size - 1) / block_size;
+  }
+
+  template <typename Count, typename Emit>
+  uint64_t run(size_t n, Count count, Emit emit) {
+    if (n == 0)
+      return 0;
+
+    const size_t nb = num_blocks(n);
+    uint64_t *sums = m_sums;
+    uint64_t *total = m_total;
+
+    m_q.parallel_for(sycl::range<1>(nb), [=](sycl::id<1> b) {
+         const size_t begin = b[0] * block_size;
+         const size_t end = sycl::min(begin + block_size, n);
+
+         uint64_t sum = 0;
+         for (size_t i = begin; i < end; ++i)
+           sum += count(i);
+
+         sums[b] = sum;
+       }).wait();
+
+    m_q.single_task([=]() {
+         uint64_t offset = 0;
+         for (size_t b = 0; b < nb; ++b) {
+           const uint64_t sum = sums[b];
+           sums[b] = offset;
+           offset += sum;
+         }
+         sums[nb] = offset;
+       }).wait();
+
+    m_q.parallel_for(sycl::range<1>(nb), [=](sycl::id<1> b) {
+         const size_t begin = b[0] * block_size;
+         const size_t end = sycl::min(begin + block_size, n);
+
+         uint64_t offset = sums[b];
+         for (size_t i = begin; i < end; ++i) {
+           // count before emitting, in case the scan is in place
+           const uint64_t c = count(i);
+           emit(i, offset);
+           offset += c;
+         }
+       }).wait();
+
+    m_q.memcpy(total, sums + nb, sizeof(uint64_t)).wait();
+
+    return *total;
+  }
+
+  sycl::queue &m_q;
+  uint64_t *m_sums = nullptr;
+  uint64_t *m_total = nullptr;
+};
+
+#endif // __scan_sycl_hpp
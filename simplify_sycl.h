@@ -0,0 +1,295 @@
+#ifndef __simplify_sycl_hpp
+#define __simplify_sycl_hpp
+
+#include "particles_sycl.h"
+#include "scan_sycl.h"
+
+#include <CL/sycl.hpp>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <iostream>
+#include <utility>
+#include <vector>
+
+namespace sycl = cl::sycl;
+
+// -------------------------------------------------------------------------
+
+/// distance of p to the segment from a to b
+inline float segment_distance(const sycl::float3 &p, const sycl::float3 &a,
+                              const sycl::float3 &b) {
+  const sycl::float3 ab = b - a;
+  const float length2 = sycl::dot(ab, ab);
+  const float s =
+      length2 > 0.0f ? sycl::clamp(sycl::dot(p - a, ab) / length2, 0.0f, 1.0f)
+                     : 0.0f;
+
+  return sycl::length(p - (a + s * ab));
+}
+
+// -------------------------------------------------------------------------
+
+/// trajectory output that simplifies the trajectories on the device and
+/// keeps only their significant vertices, with their times, in host memory.
+/// The steps of every seed are collected in a device window of up to
+/// window_steps steps; a full window is reduced with the Douglas-Peucker
+/// algorithm, so that every dropped point is within tolerance of the
+/// polyline of the kept vertices, and only the kept vertices are packed
+/// and copied back. The last point of a window is always kept and starts
+/// the next window. Windows are flushed on the host thread, which waits
+/// for the device, like the compaction of the active particles.
+class simplified_trajectories {
+public:
+  static constexpr unsigned int window_steps = 256;
+
+  simplified_trajectories(sycl::queue &q, unsigned int num_seeds,
+                          float tolerance)
+      : m_q(q), m_num_seeds(num_seeds), m_tolerance(tolerance),
+        m_scan(q, num_seeds) {
+    const size_t rows = window_steps + 1;
+
+    m_window = {sycl::malloc_device<float>(
+                    particle_columns::size(rows, num_seeds), q),
+                num_seeds};
+    m_kept = {sycl::malloc_device<float>(
+                  particle_columns::size(rows, num_seeds), q),
+              num_seeds};
+    m_keep = sycl::malloc_device<uint8_t>(rows * num_seeds, q);
+    m_count = sycl::malloc_device<unsigned int>(num_seeds, q);
+    m_offset = sycl::malloc_device<unsigned int>(num_seeds, q);
+    m_packed = sycl::malloc_device<float>(rows * num_seeds * 4, q);
+    m_stats = sycl::malloc_device<uint64_t>(1, q);
+    q.memset(m_stats, 0, sizeof(uint64_t)).wait();
+  }
+
+  ~simplified_trajectories() {
+    m_q.wait();
+    sycl::free(m_stats, m_q);
+    sycl::free(m_packed, m_q);
+    sycl::free(m_offset, m_q);
+    sycl::free(m_count, m_q);
+    sycl::free(m_keep, m_q);
+    sycl::free(m_kept.data, m_q);
+    sycl::free(m_window.data, m_q);
+  }
+
+  simplified_trajectories(const simplified_trajectories &) = delete;
+  simplified_trajectories &
+  operator=(const simplified_trajectories &) = delete;
+
+  unsigned int num_seeds() const { return m_num_seeds; }
+
+  /// append the steps [step, step + num_steps) of the device columns
+  /// trajectory to the window once computed is complete, and simplify it
+  /// whenever it is full; see host_trajectories::copy()
+  sycl::event copy(sycl::queue &q, const particle_columns &trajectory,
+                   unsigned int, unsigned int num_steps,
+                   sycl::event computed) {
+    for (unsigned int first = 0; first < num_steps;) {
+      const unsigned int rows =
+          std::min(num_steps - first, window_steps + 1 - m_rows);
+      const particle_columns window = m_window;
+      const unsigned int row = m_rows;
+
+      m_appended = q.submit([&](sycl::handler &h) {
+        h.depends_on({computed, m_appended});
+        h.parallel_for(sycl::range<1>(m_num_seeds), [=](sycl::id<1> i) {
+          for (unsigned int k = 0; k < rows; ++k)
+            window.store(row + k, i, trajectory.position(first + k, i),
+                         trajectory.time(first + k, i));
+        });
+      });
+
+      first += rows;
+      m_rows += rows;
+
+      if (m_rows == window_steps + 1)
+        flush();
+    }
+
+    return m_appended;
+  }
+
+  /// simplify the remaining steps; returns the number of rows of columns()
+  unsigned int finish() {
+    if (m_rows > (m_first ? 0 : 1))
+      flush();
+
+    // the kept vertices of every seed, one after the other in its columns,
+    // followed by NaN times
+    std::vector<unsigned int> length(m_num_seeds, 0);
+    for (const batch &b : m_batches)
+      for (unsigned int i = 0; i < m_num_seeds; ++i)
+        length[i] += b.count[i];
+
+    m_num_rows = m_num_seeds > 0
+                     ? *std::max_element(length.begin(), length.end())
+                     : 0;
+    m_storage.assign(particle_columns::size(m_num_rows, m_num_seeds),
+                     float(NAN));
+    const particle_columns columns = this->columns();
+
+    std::fill(length.begin(), length.end(), 0);
+    for (const batch &b : m_batches) {
+      const float *vertex = b.vertices.data();
+
+      for (unsigned int i = 0; i < m_num_seeds; ++i)
+        for (unsigned int j = 0; j < b.count[i]; ++j, vertex += 4)
+          columns.store(length[i]++, i, {vertex[0], vertex[1], vertex[2]},
+                        vertex[3]);
+    }
+
+    uint64_t num_points = 0;
+    m_q.memcpy(&num_points, m_stats, sizeof(uint64_t)).wait();
+
+    std::cerr << "simplified " << num_points << " points to " << m_num_kept
+              << " vertices with tolerance " << m_tolerance << " (ratio "
+              << double(num_points) / std::max<uint64_t>(1, m_num_kept)
+              << ", " << m_copied_bytes / (1024.0 * 1024.0)
+              << " MiB instead of "
+              << num_points * 4 * sizeof(float) / (1024.0 * 1024.0)
+              << " MiB copied back)\n";
+
+    return m_num_rows;
+  }
+
+  /// the kept vertices of every seed, valid after finish()
+  particle_columns columns() { return {m_storage.data(), m_num_seeds}; }
+
+private:
+  /// the kept vertices of one window: count of every seed, and their
+  /// positions and times packed by seed
+  struct batch {
+    std::vector<unsigned int> count;
+    std::vector<float> vertices;
+  };
+
+  /// simplify the steps in the window, copy the kept vertices back and
+  /// restart the window from its last step
+  void flush() {
+    const particle_columns window = m_window, kept = m_kept;
+    const unsigned int rows = m_rows, n = m_num_seeds;
+    const unsigned int begin = m_first ? 0 : 1; // row 0 was kept before
+    const float tolerance = m_tolerance;
+    uint8_t *keep = m_keep;
+    unsigned int *count = m_count;
+    uint64_t *stats = m_stats;
+
+    m_q.submit([&](sycl::handler &h) {
+         h.depends_on(m_appended);
+         h.parallel_for(sycl::range<1>(n), [=](sycl::id<1> i) {
+           // a trajectory ends at its first NaN time
+           unsigned int m = 0;
+           while (m < rows && !sycl::isnan(window.time(m, i)))
+             ++m;
+
+           for (unsigned int k = 0; k < m; ++k)
+             keep[k * n + i] = k == 0 || k == m - 1;
+
+           // every pass splits all segments at their farthest point, if it
+           // is farther than tolerance, as the recursion of Douglas-Peucker
+           for (bool split = m > 2; split;) {
+             split = false;
+
+             for (unsigned int a = 0, b = 1; b < m; ++b) {
+               if (!keep[b * n + i])
+                 continue;
+
+               const sycl::float3 pa = window.position(a, i);
+               const sycl::float3 pb = window.position(b, i);
+               float farthest = tolerance;
+               unsigned int f = 0;
+
+               for (unsigned int k = a + 1; k < b; ++k) {
+                 const float d =
+                     segment_distance(window.position(k, i), pa, pb);
+                 if (d > farthest) {
+                   farthest = d;
+                   f = k;
+                 }
+               }
+
+               if (f > 0) {
+                 keep[f * n + i] = 1;
+                 split = true;
+               }
+
+               a = b;
+             }
+           }
+
+           unsigned int c = 0;
+           for (unsigned int k = begin; k < m; ++k)
+             if (keep[k * n + i])
+               kept.store(c++, i, window.position(k, i), window.time(k, i));
+
+           count[i] = c;
+
+           sycl::atomic_ref<uint64_t, sycl::memory_order::relaxed,
+                            sycl::memory_scope::device,
+                            sycl::access::address_space::global_space>(
+               stats[0])
+               .fetch_add(m > begin ? m - begin : 0);
+
+           // the last step starts the next window, and ends it if the
+           // trajectory ended in this one
+           const float t = m == rows ? window.time(rows - 1, i) : float(NAN);
+           window.store(0, i, window.position(rows - 1, i), t);
+         });
+       }).wait();
+
+    // pack the kept vertices by seed and copy only them
+    const unsigned int num_kept = m_scan.exclusive_scan(count, m_offset, n);
+    const unsigned int *offset = m_offset;
+    float *packed = m_packed;
+
+    m_q.parallel_for(sycl::range<1>(n), [=](sycl::id<1> i) {
+         float *vertex = packed + size_t(offset[i]) * 4;
+         for (unsigned int j = 0; j < count[i]; ++j, vertex += 4)
+           for (unsigned int c = 0; c < 4; ++c)
+             vertex[c] = kept.column(j, c)[i];
+       }).wait();
+
+    batch b;
+    b.count.resize(n);
+    b.vertices.resize(size_t(num_kept) * 4);
+    m_q.memcpy(b.count.data(), count, sizeof(unsigned int) * n).wait();
+    m_q.memcpy(b.vertices.data(), packed, sizeof(float) * b.vertices.size())
+        .wait();
+
+    m_num_kept += num_kept;
+    m_copied_bytes +=
+        sizeof(unsigned int) * n + sizeof(float) * b.vertices.size();
+    m_batches.push_back(std::move(b));
+
+    m_rows = 1;
+    m_first = false;
+  }
+
+  sycl::queue &m_q;
+  unsigned int m_num_seeds;
+  float m_tolerance;
+  device_scan m_scan;
+
+  particle_columns m_window; // device memory, the steps of the window
+  particle_columns m_kept;   // device memory, the kept vertices per seed
+  uint8_t *m_keep = nullptr;
+  unsigned int *m_count = nullptr;  // kept vertices of every seed
+  unsigned int *m_offset = nullptr; // their first index in m_packed
+  float *m_packed = nullptr;
+  uint64_t *m_stats = nullptr; // number of simplified points
+
+  unsigned int m_rows = 0; // filled rows of the window
+  bool m_first = true;     // row 0 of the window is the seed
+  sycl::event m_appended;  // the last copy into the window
+
+  std::vector<batch> m_batches;
+  uint64_t m_num_kept = 0;
+  uint64_t m_copied_bytes = 0;
+
+  std::vector<float> m_storage;
+  unsigned int m_num_rows = 0;
+};
+
+#endif // __simplify_sycl_hpp
@@ -0,0 +1,104 @@
+#ifndef __sort_sycl_hpp
+#define __sort_sycl_hpp
+
+#include <CL/sycl.hpp>
+#include <cstdint>
+
+namespace sycl = cl::sycl;
+
+// -------------------------------------------------------------------------
+
+/// device-side sort of up to `capacity` key/value pairs with a bitonic
+/// sorting network. The input is padded to a power of two with keys that
+/// sort last; every stage of the network is one launch.
+class device_sort {
+public:
+  device_sort(sycl::queue &q, size_t capacity) : m_q(q) {
+    while (m_capacity < capacity)
+      m_capacity *= 2;
+
+    m_keys = sycl::malloc_device<uint32_t>(m_capacity, m_q);
+    m_values = sycl::malloc_device<uint32_t>(m_capacity, m_q);
+  }
+
+  ~device_sort() {
+    sycl::free(m_keys, m_q);
+    sycl::free(m_values, m_q);
+  }
+
+  device_sort(const device_sort &) = delete;
+  device_sort &operator=(const device_sort &) = delete;
+
+  /// sort keys[0..n) ascending and permute values[0..n) along; the order of
+  /// equal keys is not preserved
+  void sort_by_key(uint32_t *keys, uint32_t *values, size_t n) {
+    if (n < 2)
+      return;
+
+    size_t padded = 1;
+    while (padded < n)
+      padded *= 2;
+
+    uint32_t *k = m_keys;
+    uint32_t *v = m_values;
+
+    m_q.parallel_for(sycl::range<1>(padded), [=](sycl::id<1> i) {
+         k[i] = i < n ? keys[i] : UINT32_MAX;
+         v[i] = i < n ? values[i] : 0u;
+       }).wait();
+
+    for (size_t size = 2; size <= padded; size *= 2) {
+      for (size_t stride = size / 2; stride > 0; stride /= 2) {
+        m_q.parallel_for(sycl::range<1>(padded), [=](sycl::id<1> id) {
+             const size_t i = id[0];
+             const size_t l = i ^ stride;
+
+             if (l <= i)
+               return;
+
+             const bool ascending = (i & size) == 0;
+
+             if ((k[i] > k[l]) == ascending && k[i] != k[l]) {
+               const uint32_t key = k[i];
+               k[i] = k[l];
+               k[l] = key;
+
+               const uint32_t value = v[i];
+               v[i] = v[l];
+               v[l] = value;
+             }
+           }).wait();
+      }
+    }
+
+    m_q.parallel_for(sycl::range<1>(n), [=](sycl::id<1> i) {
+         keys[i] = k[i];
+         values[i] = v[i];
+       }).wait();
+  }
+
+private:
+  sycl::queue &m_q;
+  size_t m_capacity = 1;
+  uint32_t *m_keys = nullptr;
+  uint32_t *m_values = nullptr;
+};
+
+// -------------------------------------------------------------------------
+
+/// interleave the lower 10 bits of the cell coordinates into a 30 bit Morton
+/// (Z-order) code
+inline uint32_t morton_code(uint32_t i, uint32_t j, uint32_t k) {
+  auto spread = [](uint32_t x) {
+    x &= 0x3ff;
+    x = (x | (x << 16)) & 0x030000ff;
+    x = (x | (x << 8)) & 0x0300f00f;
+    x = (x | (x << 4)) & 0x030c30c3;
+    x = (x | (x << 2)) & 0x09249249;
+    return x;
+  };
+
+  return spread(i) | (spread(j) << 1) | (spread(k) << 2);
+}
+
+#endif // __sort_sycl_hpp
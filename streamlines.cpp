@@ -115,8 +115,9 @@ struct seed_generator {
 
 // -------------------------------------------------------------------------
 
-void save_as_vtk(std::vector<integrator_rk4> houtput, unsigned int num_seeds,
-                 unsigned int num_steps, const std::string &filename) {
+void save_as_vtk(const std::vector<integrator_rk4> &houtput,
+                 unsigned int num_seeds, unsigned int num_steps,
+                 const std::string &filename) {
   std::vector<int> offset, connectivity;
   std::vector<float> coord, itime;
 
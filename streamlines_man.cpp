@@ -1,11 +1,28 @@
+#include "devices_sycl.h"
 #include "hdf5_field_sycl.h"
+#include "hdf5_output.h"
+#include "integrators_simd.h"
+#include "integrators_sycl.h"
+#include "pack_sycl.h"
+#include "particles_sycl.h"
+#include "scan_sycl.h"
+#include "simplify_sycl.h"
+#include "sort_sycl.h"
 
 #include <CL/sycl.hpp>
 
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <deque>
+#include <exception>
 #include <fstream>
 #include <iostream>
 #include <math.h>
+#include <mutex>
+#include <sstream>
+#include <thread>
 #include <type_traits>
 #include <vector>
 
@@ -19,122 +36,668 @@ std::ostream &operator<<(std::ostream &out, const sycl::float3 &p) {
 
 // -------------------------------------------------------------------------
 
-struct integrator_rk4 {
-  sycl::float3 p; // position
-  float t;        // time
+// -------------------------------------------------------------------------
 
-  template <typename Field> void step(const Field &field, const float dt) {
-    if (sycl::isnan(t))
-      return;
+/// outcome of integrate_seeds()
+struct integration_result {
+  unsigned int num_written = 0; // number of steps stored in the output
+  bool terminated = false;      // all particles left the domain
+  double seconds = 0.0;         // time spent in the integration loop
+  uint64_t cache_hits = 0;      // lookups served by the corner caches
+  uint64_t cache_misses = 0;    // lookups that loaded a cell
+};
 
-    const float dt_half = 0.5 * dt;
+/// seed output.num_seeds() particles, seeds first_seed, first_seed + 1, ...
+/// of total_seeds, and integrate them on q into output: a host_trajectories,
+/// device_trajectories, quantized_trajectories, simplified_trajectories or
+/// vtp_stream. Every seed starts as a copy of seed_state; the final states
+/// are copied to final_states. Field is either a steady hdf5_field or an
+/// hdf5_timeseries, which provides the kernels with a view per launch.
+template <typename Integrator, typename Field, typename Output>
+integration_result
+integrate_seeds(sycl::queue &q, Field &field, const Integrator &seed_state,
+                unsigned int first_seed, unsigned int total_seeds,
+                Output &output, Integrator *final_states,
+                unsigned int num_steps, unsigned int steps_per_launch,
+                unsigned int compact_interval, unsigned int sort_interval,
+                unsigned int num_buffers, bool use_cache, float dt) {
+  const unsigned int num_seeds = output.num_seeds();
 
-    sycl::float3 k1, k2, k3, k4;
+  unsigned int num_written = 0; // number of steps stored in output
 
-    if (!field.get(p, k1))
-      goto outside;
+  // create initial particle states
+  //
+  Integrator *d_integrators = sycl::malloc_device<Integrator>(
+      num_seeds, q); // a vector with num_seeds elements of type Integrator
+                     // is created on the device
 
-    if (!field.get(p + dt_half * k1, k2))
-      goto outside;
+  // device-resident trajectory buffers, holding steps_per_launch steps in
+  // the same column layout as the output. With two buffers, a launch computes
+  // into one of them while the previous launch is still copied back from the
+  // other; launches and copies are ordered by events only, as the queue is
+  // out-of-order.
+  std::vector<particle_columns> d_trajectory(num_buffers);
+  std::vector<sycl::event> copied(num_buffers);
+  sycl::event computed;
 
-    if (!field.get(p + dt_half * k2, k3))
-      goto outside;
+  for (auto &buffer : d_trajectory)
+    buffer = {sycl::malloc_device<float>(
+                  particle_columns::size(steps_per_launch, num_seeds), q),
+              num_seeds};
 
-    if (!field.get(p + dt * k3, k4))
-      goto outside;
+  const particle_columns seeds = d_trajectory[0];
 
-    p += dt / 6.0f * (k1 + k2 + k3 + k4);
-    t += dt;
+  q.parallel_for(sycl::range<1>(num_seeds), [=](sycl::id<1> i) {
+     Integrator val = seed_state;
+     val.t = 0.0f;
+     val.p = seed_position(first_seed + i, total_seeds);
+     d_integrators[i] = val;
+     seeds.store(0, i, val.p, val.t);
+   }).wait();
 
-    return;
+  // the first launch overwrites the seeds once they are copied
+  copied[0] = output.copy(q, seeds, 0, 1, sycl::event());
+  num_written = 1;
+
+  // indices of the particles that are still inside the domain. The list is
+  // compacted on the device every compact_interval steps, so that launches
+  // only cover live particles.
+  unsigned int *d_active = sycl::malloc_device<unsigned int>(num_seeds, q);
+  unsigned int *d_active_next = sycl::malloc_device<unsigned int>(num_seeds, q);
+  unsigned int num_active = num_seeds;
+  unsigned int steps_since_compaction = 0;
+  device_scan scan(q, num_seeds);
+
+  // every sort_interval steps the active list is sorted by the Morton code
+  // of the cell each particle is in, so that neighbouring work items gather
+  // from nearby voxels again. The list maps work items to seeds, so the
+  // output stays ordered by seed.
+  uint32_t *d_keys = sycl::malloc_device<uint32_t>(num_seeds, q);
+  unsigned int steps_since_sort = 0;
+  device_sort sort(q, num_seeds);
+
+  q.parallel_for(sycl::range<1>(num_seeds),
+                 [=](sycl::id<1> i) { d_active[i] = i; })
+      .wait();
+
+  // hits and misses of the per-particle corner caches
+  uint64_t *d_cache_stats = sycl::malloc_device<uint64_t>(2, q);
+  q.memset(d_cache_stats, 0, 2 * sizeof(uint64_t)).wait();
+
+  // perform integration steps integrate particles, steps_per_launch at a
+  // time: each work item keeps its particle in registers and only touches
+  // global memory to record the trajectory
+  const auto start = std::chrono::steady_clock::now();
+
+  unsigned int s = 0, launch = 0;
+  while (s < num_steps - 1 && num_active > 0) {
+    std::cerr << "." << std::flush; // flush the cerror stream
+
+    unsigned int num_fused = std::min(steps_per_launch, num_steps - 1 - s);
+
+    // time-varying fields only keep a few slices resident, so a launch may
+    // have to stop early
+    const float t_begin = s * dt;
+    const auto field_view = field.view(t_begin, t_begin + num_fused * dt);
+    const float t_fit = (field_view.end_time() - t_begin) / dt + 1e-4f;
+
+    if (t_fit < num_fused)
+      num_fused = std::max(0.0f, std::floor(t_fit));
+
+    if (num_fused == 0) {
+      std::cerr << "reached the end of the time series at t = " << t_begin
+                << '\n';
+      break;
+    }
+
+    const unsigned int b = launch++ % num_buffers;
+    const particle_columns trajectory = d_trajectory[b];
+
+    // the launch needs the particle states of the previous launch, and its
+    // trajectory buffer must have been copied back
+    computed = q.submit([&](sycl::handler &h) {
+      h.depends_on({computed, copied[b]});
+      h.parallel_for(sycl::range<1>(num_active), [=](sycl::id<1> j) {
+        const unsigned int i = d_active[j];
+        Integrator intg = d_integrators[i];
+
+        auto advance = [&](const auto &f) {
+          for (unsigned int k = 0; k < num_fused; ++k) {
+            intg.step(f, dt);
+            trajectory.store(k, i, intg.p, intg.t);
+          }
+        };
 
-  outside:
-    printf("Out of bounds at (%.3f, %.3f, %.3f)\n", p.x(), p.y(), p.z());
-    t = NAN;
+        if (use_cache) {
+          // the corners of the last sampled cell are kept for all fused
+          // steps of the particle
+          const cached_view<std::decay_t<decltype(field_view)>> f{field_view};
+          advance(f);
+
+          unsigned int hits = 0, misses = 0;
+          count_cache_hits(f.corners, hits, misses);
+
+          using counter =
+              sycl::atomic_ref<uint64_t, sycl::memory_order::relaxed,
+                               sycl::memory_scope::device,
+                               sycl::access::address_space::global_space>;
+          counter(d_cache_stats[0]).fetch_add(hits);
+          counter(d_cache_stats[1]).fetch_add(misses);
+        } else {
+          advance(field_view);
+        }
+
+        d_integrators[i] = intg;
+      });
+    });
+
+    // copy back all fused steps at once, while the next launch computes
+    copied[b] = output.copy(q, trajectory, num_written, num_fused, computed);
+
+    num_written += num_fused;
+    s += num_fused;
+    steps_since_compaction += num_fused;
+
+    if (compact_interval > 0 && steps_since_compaction >= compact_interval) {
+      q.wait();
+
+      // terminated particles are not launched any more, so their slots in
+      // the trajectory buffers would keep stale positions; mark them invalid
+      for (const particle_columns &trajectory : d_trajectory)
+        q.parallel_for(sycl::range<1>(num_active), [=](sycl::id<1> j) {
+           const unsigned int i = d_active[j];
+           if (sycl::isnan(d_integrators[i].t))
+             for (unsigned int k = 0; k < steps_per_launch; ++k)
+               trajectory.column(k, 3)[i] = NAN;
+         }).wait();
+
+      num_active = scan.compact(
+          d_active, d_active_next, num_active,
+          [=](unsigned int i) { return !sycl::isnan(d_integrators[i].t); });
+      std::swap(d_active, d_active_next);
+      steps_since_compaction = 0;
+    }
+
+    steps_since_sort += num_fused;
+
+    if (sort_interval > 0 && steps_since_sort >= sort_interval &&
+        num_active > 1) {
+      q.wait();
+
+      q.parallel_for(sycl::range<1>(num_active), [=](sycl::id<1> j) {
+         const sycl::float3 g =
+             field_view.grid_position(d_integrators[d_active[j]].p);
+         auto cell = [](float x) {
+           return static_cast<uint32_t>(sycl::clamp(x, 0.0f, 1023.0f));
+         };
+         d_keys[j] = morton_code(cell(g.x()), cell(g.y()), cell(g.z()));
+       }).wait();
+
+      sort.sort_by_key(d_keys, d_active, num_active);
+      steps_since_sort = 0;
+    }
   }
-};
+  q.wait();
+
+  const std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+
+  integration_result result;
+  result.num_written = num_written;
+  result.terminated = num_active == 0;
+  result.seconds = elapsed.count();
+
+  // terminated particles may not have a valid record in the last step of
+  // the output, so the final states come from the device
+  q.memcpy(final_states, d_integrators, sizeof(Integrator) * num_seeds)
+      .wait();
+
+  if (use_cache) {
+    uint64_t cache_stats[2];
+    q.memcpy(cache_stats, d_cache_stats, sizeof(cache_stats)).wait();
+    result.cache_hits = cache_stats[0];
+    result.cache_misses = cache_stats[1];
+  }
+
+  sycl::free(d_cache_stats, q);
+  sycl::free(d_keys, q);
+  sycl::free(d_active_next, q);
+  sycl::free(d_active, q);
+  for (auto buffer : d_trajectory)
+    sycl::free(buffer.data, q);
+  sycl::free(d_integrators, q);
+
+  return result;
+}
 
 // -------------------------------------------------------------------------
 
+/// print the outcome of integrating num_seeds seeds in the given time
+template <typename Integrator>
+void report(const integration_result &result, double seconds,
+            const std::vector<Integrator> &final_states) {
+  const unsigned int num_seeds = final_states.size();
+
+  std::cerr << "integrated " << num_seeds << " seeds over "
+            << result.num_written - 1 << " steps in " << seconds << " s\n";
+
+  // stop early once every particle has left the domain
+  if (result.terminated)
+    std::cerr << "all particles terminated after " << result.num_written - 1
+              << " steps\n";
+
+  print_statistics(final_states.data(), num_seeds);
+
+  const uint64_t lookups = result.cache_hits + result.cache_misses;
+  if (lookups > 0)
+    std::cerr << "corner cache: " << result.cache_hits << " hits, "
+              << result.cache_misses << " misses ("
+              << 100.0 * result.cache_hits / lookups
+              << "% of the lookups without gathers)\n";
+}
+
 // -------------------------------------------------------------------------
 
-void save_as_vtk(integrator_rk4 *houtput, unsigned int num_seeds,
-                 unsigned int num_steps, const std::string &filename) {
-  std::vector<int> offset, connectivity;
-  std::vector<float> coord, itime;
+/// seed the particles, integrate them on q and write the trajectories; see
+/// integrate_seeds(). With stream, binary VTP output is written by a
+/// vtp_stream during the integration instead of after it. Quantized output
+/// is encoded on the device by a quantized_trajectories, in the box of the
+/// grid grown by 1/32 of its size on every side, as the last position of a
+/// particle may lie outside the grid. Other output is packed on the device
+/// by a device_trajectories where it fits. With a positive simplify
+/// tolerance, the trajectories are simplified on the device by a
+/// simplified_trajectories, and only their significant vertices are
+/// written.
+template <typename Integrator, typename Field>
+void integrate(sycl::queue &q, Field &field,
+               const Integrator &seed_state, unsigned int num_seeds,
+               unsigned int num_steps, unsigned int steps_per_launch,
+               unsigned int compact_interval, unsigned int sort_interval,
+               unsigned int num_buffers, bool use_cache, float dt,
+               output_format vtp, bool stream, float simplify) {
+  std::vector<Integrator> final_states(num_seeds);
+
+  if (simplify > 0.0f) {
+    simplified_trajectories output(q, num_seeds, simplify);
+
+    const integration_result result = integrate_seeds(
+        q, field, seed_state, 0, num_seeds, output, final_states.data(),
+        num_steps, steps_per_launch, compact_interval, sort_interval,
+        num_buffers, use_cache, dt);
+    std::cerr << '\n';
+
+    report(result, result.seconds, final_states);
+
+    const unsigned int num_rows = output.finish();
+    if (vtp != output_format::none)
+      save_trajectories(output.columns(), num_rows, vtp);
+    return;
+  }
+
+  if (stream &&
+      (vtp == output_format::binary || vtp == output_format::zlib)) {
+    vtp_stream output(q, "test.vtp", num_seeds, steps_per_launch, vtp);
+
+    const integration_result result = integrate_seeds(
+        q, field, seed_state, 0, num_seeds, output, final_states.data(),
+        num_steps, steps_per_launch, compact_interval, sort_interval,
+        num_buffers, use_cache, dt);
+    std::cerr << '\n';
+
+    report(result, result.seconds, final_states);
+    output.finish();
+    return;
+  }
+
+  if (vtp == output_format::quantized) {
+    const sycl::float3 lower = field.lower(), upper = field.upper();
+    const sycl::float3 margin = (upper - lower) / 32.0f;
+    quantized_trajectories output(q, num_seeds, num_steps, steps_per_launch,
+                                  {lower - margin, upper + margin});
+
+    const integration_result result = integrate_seeds(
+        q, field, seed_state, 0, num_seeds, output, final_states.data(),
+        num_steps, steps_per_launch, compact_interval, sort_interval,
+        num_buffers, use_cache, dt);
+    std::cerr << '\n';
+
+    report(result, result.seconds, final_states);
+    save_as_quantized_hdf5(output, dt, "test.h5");
+    return;
+  }
+
+  // trajectories to be written are kept and packed on the device, which
+  // copies back only their valid points, if they fit into half of its
+  // memory; the rest is left to the field
+  const size_t device_memory =
+      q.get_device().get_info<sycl::info::device::global_mem_size>();
+
+  if (vtp != output_format::none &&
+      device_trajectories::device_size(num_steps, num_seeds) <=
+          device_memory / 2) {
+    device_trajectories output(q, num_seeds, num_steps);
+
+    const integration_result result = integrate_seeds(
+        q, field, seed_state, 0, num_seeds, output, final_states.data(),
+        num_steps, steps_per_launch, compact_interval, sort_interval,
+        num_buffers, use_cache, dt);
+    std::cerr << '\n';
+
+    report(result, result.seconds, final_states);
+    save_trajectories(output.pack(result.num_written), vtp);
+    return;
+  }
+
+  // prepare output data
+  // Here the positions and times of num_steps * num_seeds particle states
+  // are stored in host memory, as one column per coordinate and step.
+  host_trajectories houtput = {
+      {sycl::malloc_host<float>(particle_columns::size(num_steps, num_seeds),
+                                q),
+       num_seeds}};
+
+  const integration_result result = integrate_seeds(
+      q, field, seed_state, 0, num_seeds, houtput, final_states.data(),
+      num_steps, steps_per_launch, compact_interval, sort_interval,
+      num_buffers, use_cache, dt);
+  std::cerr << '\n';
+
+  report(result, result.seconds, final_states);
+
+  // copy back and output
+  if (vtp != output_format::none)
+    save_trajectories(houtput.columns, result.num_written, vtp);
+
+  sycl::free(houtput.columns.data, q);
+}
+
+// -------------------------------------------------------------------------
+
+/// integrate on all queues, each with its own copy of the field. The seeds
+/// are handed out in chunks of chunk_size by a shared counter, with one
+/// host thread per queue, so that devices whose particles terminate early
+/// take more chunks.
+template <typename Integrator, typename Field>
+void integrate_devices(std::vector<sycl::queue> &queues,
+                       std::deque<Field> &fields, const Integrator &seed_state,
+                       unsigned int num_seeds, unsigned int chunk_size,
+                       unsigned int num_steps, unsigned int steps_per_launch,
+                       unsigned int compact_interval,
+                       unsigned int sort_interval, unsigned int num_buffers,
+                       bool use_cache, float dt, output_format vtp) {
+  std::vector<float> storage(particle_columns::size(num_steps, num_seeds));
+  const particle_columns houtput = {storage.data(), num_seeds};
+
+  std::vector<Integrator> final_states(num_seeds);
 
-  unsigned int num_points = 0;
+  std::atomic<unsigned int> next_seed(0);
 
-  // unpack all the streamline points into separate arrays
-  // (discarding any invalid points)
-  auto iter = houtput;
+  std::mutex mutex; // guards result, error and the output stream
+  integration_result result;
+  result.terminated = true;
 
-  for (unsigned int seed = 0; seed < num_seeds; ++seed, ++iter) {
-    offset.push_back(connectivity.size());
+  // the first error of a device, which stops the others at their next chunk
+  std::exception_ptr error;
 
-    auto iiter = iter;
+  auto worker = [&](size_t d) {
+    sycl::queue &q = queues[d];
 
-    for (unsigned int step = 0; step < num_steps; ++step, iiter += num_seeds) {
-      auto &si = *iiter;
+    // a chunk is integrated into host memory of its device and then
+    // scattered into the columns of houtput
+    host_trajectories chunk_output = {
+        {sycl::malloc_host<float>(
+             particle_columns::size(num_steps, chunk_size), q),
+         chunk_size}};
+    particle_columns &chunk = chunk_output.columns;
 
-      if (isnan(si.t))
-        break;
+    unsigned int num_chunks = 0, num_chunk_seeds = 0;
+    double busy = 0.0;
 
-      coord.push_back(si.p.x());
-      coord.push_back(si.p.y());
-      coord.push_back(si.p.z());
-      itime.push_back(si.t);
+    try {
+      for (;;) {
+        const unsigned int first = next_seed.fetch_add(chunk_size);
 
-      connectivity.push_back(num_points);
+        if (first >= num_seeds)
+          break;
 
-      ++num_points;
+        chunk.num_seeds = std::min(chunk_size, num_seeds - first);
+
+        const integration_result r = integrate_seeds(
+            q, fields[d], seed_state, first, num_seeds, chunk_output,
+            final_states.data() + first, num_steps, steps_per_launch,
+            compact_interval, sort_interval, num_buffers, use_cache, dt);
+
+        // steps after the last one written by this chunk end its trajectories
+        for (unsigned int step = 0; step < num_steps; ++step)
+          for (unsigned int c = 0; c < 4; ++c) {
+            float *column = houtput.column(step, c) + first;
+
+            if (step < r.num_written)
+              std::copy_n(chunk.column(step, c), chunk.num_seeds, column);
+            else if (c == 3)
+              std::fill_n(column, chunk.num_seeds, float(NAN));
+          }
+
+        ++num_chunks;
+        num_chunk_seeds += chunk.num_seeds;
+        busy += r.seconds;
+
+        std::lock_guard<std::mutex> lock(mutex);
+        result.num_written = std::max(result.num_written, r.num_written);
+        result.terminated = result.terminated && r.terminated;
+        result.cache_hits += r.cache_hits;
+        result.cache_misses += r.cache_misses;
+      }
+    } catch (...) {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (!error)
+        error = std::current_exception();
+      next_seed = num_seeds;
     }
+
+    sycl::free(chunk.data, q);
+
+    // in one piece, as the other threads print their progress
+    std::ostringstream line;
+    line << "\ndevice " << d << " ("
+         << q.get_device().template get_info<sycl::info::device::name>()
+         << "): " << num_chunks << " chunks, " << num_chunk_seeds << " seeds, "
+         << busy << " s\n";
+
+    std::lock_guard<std::mutex> lock(mutex);
+    std::cerr << line.str();
+  };
+
+  const auto start = std::chrono::steady_clock::now();
+
+  std::vector<std::thread> threads;
+  for (size_t d = 0; d < queues.size(); ++d)
+    threads.emplace_back(worker, d);
+
+  for (auto &thread : threads)
+    thread.join();
+
+  if (error)
+    std::rethrow_exception(error);
+
+  const std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  std::cerr << '\n';
+
+  report(result, elapsed.count(), final_states);
+
+  if (vtp != output_format::none)
+    save_trajectories(houtput, result.num_written, vtp);
+}
+
+// -------------------------------------------------------------------------
+
+/// integrate with an out-of-core field. Every launch advances each active
+/// particle by up to steps_per_launch steps; a step that needs a brick that
+/// is not resident is discarded and the particle is parked until the brick
+/// has been loaded after the launch. Particles thus advance at their own
+/// pace, and the kernels write their trajectories straight to host memory.
+template <typename Integrator>
+void integrate_out_of_core(sycl::queue &q, hdf5_brick_field &field,
+                           const Integrator &seed_state,
+                           unsigned int num_seeds, unsigned int num_steps,
+                           unsigned int steps_per_launch, float dt,
+                           output_format vtp) {
+  // steps a particle has not reached keep a NaN time
+  particle_columns houtput = {
+      sycl::malloc_host<float>(particle_columns::size(num_steps, num_seeds), q),
+      num_seeds};
+  q.fill(houtput.data, float(NAN), particle_columns::size(num_steps, num_seeds))
+      .wait();
+
+  Integrator *d_integrators = sycl::malloc_device<Integrator>(num_seeds, q);
+  unsigned int *d_steps = sycl::malloc_device<unsigned int>(num_seeds, q);
+  unsigned int *d_active = sycl::malloc_device<unsigned int>(num_seeds, q);
+  unsigned int *d_active_next = sycl::malloc_device<unsigned int>(num_seeds, q);
+  unsigned int *d_parked = sycl::malloc_device<unsigned int>(1, q);
+  device_scan scan(q, num_seeds);
+
+  q.parallel_for(sycl::range<1>(num_seeds), [=](sycl::id<1> i) {
+     Integrator val = seed_state;
+     val.t = 0.0f;
+     val.p = seed_position(i, num_seeds);
+     d_integrators[i] = val;
+     d_steps[i] = 0;
+     d_active[i] = i;
+     houtput.store(0, i, val.p, val.t);
+   }).wait();
+  q.memset(d_parked, 0, sizeof(unsigned int)).wait();
+
+  const auto start = std::chrono::steady_clock::now();
+
+  unsigned int num_active = num_seeds, num_launches = 0;
+  while (num_active > 0) {
+    std::cerr << "." << std::flush;
+
+    const brick_field_view field_view = field.view();
+    const unsigned int last_step = num_steps - 1;
+
+    q.parallel_for(sycl::range<1>(num_active), [=](sycl::id<1> j) {
+       const unsigned int i = d_active[j];
+       Integrator intg = d_integrators[i];
+       unsigned int step = d_steps[i];
+
+       const parking_view f{field_view};
+
+       for (unsigned int k = 0; k < steps_per_launch && step < last_step &&
+                                !sycl::isnan(intg.t);
+            ++k) {
+         const Integrator before = intg;
+         intg.step(f, dt);
+
+         if (f.missing) {
+           intg = before;
+           sycl::atomic_ref<unsigned int, sycl::memory_order::relaxed,
+                            sycl::memory_scope::device,
+                            sycl::access::address_space::global_space>(
+               *d_parked)
+               .fetch_add(1u);
+           break;
+         }
+
+         houtput.store(++step, i, intg.p, intg.t);
+       }
+
+       d_integrators[i] = intg;
+       d_steps[i] = step;
+     }).wait();
+
+    ++num_launches;
+
+    num_active = scan.compact(d_active, d_active_next, num_active,
+                              [=](unsigned int i) {
+                                return !sycl::isnan(d_integrators[i].t) &&
+                                       d_steps[i] < last_step;
+                              });
+    std::swap(d_active, d_active_next);
+
+    field.load_requested();
   }
+  std::cerr << '\n';
+
+  const std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
 
-  // write to VTP file
-  std::ofstream out(filename);
+  unsigned int num_parked = 0;
+  q.memcpy(&num_parked, d_parked, sizeof(unsigned int)).wait();
 
-  out << "<?xml version=\"1.0\"?>\n"
-      << "<VTKFile type=\"PolyData\" version=\"0.1\" "
-         "byte_order=\"LittleEndian\">"
-      << "<PolyData>" << "<Piece " << "NumberOfPoints=\"" << num_points << "\" "
-      << "NumberOfVerts=\"0\" " << "NumberOfLines=\"" << num_seeds << "\" "
-      << "NumberOfStris=\"0\" " << "NumberOfPolys=\"0\">" << "<Points>"
-      << "<DataArray " << "type=\"Float32\" " << "NumberOfComponents=\"3\" "
-      << "format=\"ascii\">\n";
+  std::cerr << "integrated " << num_seeds << " seeds over " << num_steps - 1
+            << " steps in " << elapsed.count() << " s (" << num_launches
+            << " launches, " << num_parked << " parked steps)\n";
+  field.print_statistics();
 
-  for (auto c : coord)
-    out << c << ' ';
+  std::vector<Integrator> final_states(num_seeds);
+  q.memcpy(final_states.data(), d_integrators, sizeof(Integrator) * num_seeds)
+      .wait();
+  print_statistics(final_states.data(), num_seeds);
 
-  out << "</DataArray>" << "</Points>";
+  if (vtp != output_format::none)
+    save_trajectories(houtput, num_steps, vtp);
 
-  out << "<Lines>" << "<DataArray Name=\"connectivity\" "
-      << "type=\"Int32\" format=\"ascii\">\n";
+  sycl::free(d_parked, q);
+  sycl::free(d_active_next, q);
+  sycl::free(d_active, q);
+  sycl::free(d_steps, q);
+  sycl::free(d_integrators, q);
+  sycl::free(houtput.data, q);
+}
 
-  for (auto c : connectivity)
-    out << c << '\n';
+// -------------------------------------------------------------------------
 
-  out << "</DataArray>" << "<DataArray Name=\"offsets\" "
-      << "type=\"Int32\" format=\"ascii\">\n";
+/// the same as integrate(), but on the host threads with the SIMD backend of
+/// integrators_simd.h, for steady fields and fixed step schemes
+template <typename Tableau, typename Voxel>
+void integrate_host(sycl::queue &q, const hdf5_field<Voxel> &field,
+                    const integrator_erk<Tableau> &, unsigned int num_seeds,
+                    unsigned int num_steps, float dt, output_format vtp) {
+  const simd_field host_field(q, field);
 
-  for (auto o : offset)
-    out << o << '\n';
+  std::vector<float> storage(particle_columns::size(num_steps, num_seeds));
+  const particle_columns houtput = {storage.data(), num_seeds};
 
-  out << "</DataArray>" << "</Lines>" << "<PointData Scalars=\"time\">"
-      << "<DataArray Name=\"time\" type=\"Float32\" format=\"ascii\">\n";
+  for (unsigned int i = 0; i < num_seeds; ++i)
+    houtput.store(0, i, seed_position(i, num_seeds), 0.0f);
 
-  for (auto t : itime)
-    out << t << '\n';
+  const unsigned int num_threads =
+      std::max(1u, std::thread::hardware_concurrency());
 
-  out << "\n</DataArray>" << "</PointData>" << "</Piece>" << "</PolyData>"
-      << "</VTKFile>" << '\n';
+  const auto start = std::chrono::steady_clock::now();
 
-  std::cerr << "wrote " << num_seeds << " streamlines (" << num_points
-            << " points) to " << filename << '\n';
+  integrate_simd<Tableau>(host_field, houtput, num_steps, dt, num_threads);
+
+  const std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  std::cerr << "integrated " << num_seeds << " seeds over " << num_steps - 1
+            << " steps in " << elapsed.count() << " s (" << num_threads
+            << " threads, " << float_v::size() << " lanes)\n";
+
+  if (vtp != output_format::none)
+    save_trajectories(houtput, num_steps, vtp);
+}
+
+/// the SIMD backend has no adaptive schemes and no pathlines
+template <typename Integrator, typename Field>
+void integrate_host(sycl::queue &, const Field &, const Integrator &,
+                    unsigned int, unsigned int, float, output_format) {
+  std::cout << "The simd backend supports steady fields and fixed step "
+               "schemes only."
+            << std::endl;
 }
 
 // -------------------------------------------------------------------------
 
+/// a type passed as a value, to select a field type at run time
+template <typename T> struct type_tag {
+  using type = T;
+};
+
+// -------------------------------------------------------------------------
+
 int main(int argc, char *argv[]) {
   /*// here the number of seeds and of time steps are defined
   // also, the time interval.
@@ -149,6 +712,25 @@ int main(int argc, char *argv[]) {
   std::string str_steps = "";
   std::string str_vtp = "";
   std::string str_dt = "";
+  std::string str_fuse = "";
+  std::string str_scheme = "";
+  std::string str_tol = "";
+  std::string str_compact = "";
+  std::string str_buffers = "";
+  std::string str_field = "../data/jet_v4.h5";
+  std::string str_pathlines = "";
+  std::string str_storage = "";
+  std::string str_layout = "";
+  std::string str_sort = "";
+  std::string str_cache = "";
+  std::string str_backend = "";
+  std::string str_devices = "";
+  std::string str_chunk = "";
+  std::string str_bricks = "";
+  std::string str_field_cache = "";
+  std::string str_refresh_cache = "";
+  std::string str_stream = "";
+  std::string str_simplify = "";
   // parse all parameters
   std::vector<std::string> arguments;
   arguments.insert(arguments.end(), argv + 1, argv + argc);
@@ -166,6 +748,63 @@ int main(int argc, char *argv[]) {
     if (curr_arg == "-t" || curr_arg == "--dt") {
       str_dt = arguments[n + 1];
     }
+    if (curr_arg == "-k" || curr_arg == "--fuse") {
+      str_fuse = arguments[n + 1];
+    }
+    if (curr_arg == "--scheme") {
+      str_scheme = arguments[n + 1];
+    }
+    if (curr_arg == "--tol") {
+      str_tol = arguments[n + 1];
+    }
+    if (curr_arg == "-c" || curr_arg == "--compact") {
+      str_compact = arguments[n + 1];
+    }
+    if (curr_arg == "-b" || curr_arg == "--buffers") {
+      str_buffers = arguments[n + 1];
+    }
+    if (curr_arg == "-f" || curr_arg == "--field") {
+      str_field = arguments[n + 1];
+    }
+    if (curr_arg == "-p" || curr_arg == "--pathlines") {
+      str_pathlines = arguments[n + 1];
+    }
+    if (curr_arg == "--storage") {
+      str_storage = arguments[n + 1];
+    }
+    if (curr_arg == "--layout") {
+      str_layout = arguments[n + 1];
+    }
+    if (curr_arg == "--sort") {
+      str_sort = arguments[n + 1];
+    }
+    if (curr_arg == "--cache") {
+      str_cache = arguments[n + 1];
+    }
+    if (curr_arg == "--backend") {
+      str_backend = arguments[n + 1];
+    }
+    if (curr_arg == "--devices") {
+      str_devices = arguments[n + 1];
+    }
+    if (curr_arg == "--chunk") {
+      str_chunk = arguments[n + 1];
+    }
+    if (curr_arg == "--bricks") {
+      str_bricks = arguments[n + 1];
+    }
+    if (curr_arg == "--field-cache") {
+      str_field_cache = arguments[n + 1];
+    }
+    if (curr_arg == "--refresh-cache") {
+      str_refresh_cache = arguments[n + 1];
+    }
+    if (curr_arg == "--stream") {
+      str_stream = arguments[n + 1];
+    }
+    if (curr_arg == "--simplify") {
+      str_simplify = arguments[n + 1];
+    }
   }
   // -----------------------------------------------------------------------
   // here the number of seeds and of time steps are defined
@@ -202,95 +841,196 @@ int main(int argc, char *argv[]) {
   } // check if there are 0 steps, which can also indicate other problems.
   // asignation for dt:: to do, implement error handling here.
   float dt = std::stof(str_dt);
+  // number of integration steps fused into a single kernel launch. Every
+  // intermediate position goes to a device-side trajectory buffer, which is
+  // copied back once per launch instead of once per step.
+  unsigned int steps_per_launch = 1;
+  if (str_fuse.length() > 0)
+    steps_per_launch = abs(std::stoi(str_fuse));
+  if (steps_per_launch == 0 || steps_per_launch > num_steps - 1)
+    steps_per_launch = std::max(1u, num_steps - 1);
+  // number of steps between two compactions of the active particle list,
+  // zero disables compaction
+  unsigned int compact_interval = 16;
+  if (str_compact.length() > 0)
+    compact_interval = abs(std::stoi(str_compact));
+  // number of steps between two spatial re-sorts of the active particles,
+  // zero disables sorting
+  unsigned int sort_interval = 0;
+  if (str_sort.length() > 0)
+    sort_interval = abs(std::stoi(str_sort));
+  // number of device trajectory buffers: with two, copying back a launch
+  // overlaps with computing the next one, one serialises both
+  unsigned int num_buffers = 2;
+  if (str_buffers.length() > 0)
+    num_buffers = abs(std::stoi(str_buffers));
+  if (num_buffers == 0)
+    num_buffers = 1;
+  // reuse the corner voxels of the last sampled cell of every particle
+  // with --cache 1. The trajectories are the same either way; the cache
+  // holds eight voxels per work item in registers and tests the cell on
+  // every lookup, which only pays off when steps are small against cells.
+  const bool use_cache = str_cache == "1";
+  // -v 1 writes the trajectories to test.vtp as text, -v binary and -v zlib
+  // as raw or compressed binary data, and -v hdf5 to the compressed
+  // datasets of test.h5. -v quantized writes 16 bit position codes without
+  // the time to test.h5, encoded on the device before they are copied back.
+  // With --stream 1, binary VTP output of a single device run is written
+  // while integrating, without keeping all steps in host memory.
+  const output_format vtp = parse_output_format(str_vtp);
+  // with --simplify TOL, a single device run keeps only the vertices of the
+  // trajectories that are needed to stay within TOL of all their points
+  float simplify = 0.0f;
+  if (str_simplify.length() > 0)
+    simplify = std::stof(str_simplify);
+  // integration scheme (euler, heun, rk4 or rk45) and local error tolerance
+  // of the adaptive rk45 scheme, whose initial step
+  // size is dt
+  float tol = 1e-5f;
+  if (str_tol.length() > 0)
+    tol = std::stof(str_tol);
 
-  sycl::queue q; // create a SYCL queue
+  sycl::queue q; // create a SYCL queue, out-of-order by default
 
-  // load input field
-  hdf5_field field(q, "../data/jet_v4.h5");
+  // with --devices all, the seeds are shared out among all devices and CPU
+  // NUMA domains, in chunks of --chunk seeds (default: about eight chunks
+  // per device)
+  std::vector<sycl::queue> queues;
+  if (str_devices == "all" && str_backend != "simd")
+    queues = device_queues();
 
-  // prepare output data
-  // Here a vector residing in host memory of type integrator_rk4 will be
-  // declared, with num_steps * num_seeds elements.  What that kind of element
-  // is I don know yet.
-  integrator_rk4 *houtput = sycl::malloc_host<integrator_rk4>(
-      num_steps * num_seeds,
-      q); // a vector with num_steps * num_seeds elements
-          // of type integrator_rk4 is created on the host
+  unsigned int chunk_size = 0;
+  if (str_chunk.length() > 0)
+    chunk_size = abs(std::stoi(str_chunk));
+  if (chunk_size == 0 && !queues.empty())
+    chunk_size = std::max<unsigned int>(
+        256, (num_seeds + 8 * queues.size() - 1) / (8 * queues.size()));
 
-  auto houti = houtput;
+  if (str_pathlines == "1" && str_scheme == "rk45") {
+    std::cout << "Pathlines need a fixed step integration scheme." << std::endl;
+    return 1;
+  }
 
-  // create initial particle states
-  //
-  integrator_rk4 *d_integrators = sycl::malloc_device<integrator_rk4>(
-      num_seeds, q); // a vector with num_seeds elements of type integrator_rk4
-                     // is created on the device
+  // the quantized output leaves out the time, and is encoded by the
+  // integration on a single queue
+  if (vtp == output_format::quantized && str_scheme == "rk45") {
+    std::cout << "Quantized output needs a fixed step integration scheme."
+              << std::endl;
+    return 1;
+  }
 
-  q.parallel_for(sycl::range<1>(num_seeds), [&](sycl::id<1> i) {
-    float radius = 0.1f;
-    float alpha = 2.0f * M_PI * i[0] / num_seeds;
-    integrator_rk4 val;
-    val.t = 0.0f;
-    val.p = {0.5f + radius * sycl::cos(alpha), 0.01f,
-             0.5f + radius * sycl::sin(alpha)};
-    d_integrators[i] = val;
-  });
-  // and now its positions are filled with the
-  // result of seed_generator. What
-  // seed_generator returns, I don't know
-  // quite obscure struct initialisation.
-
-  // std::memcpy(houtput + (step + 1) * num_seeds, d_integrators,
-  //             sizeof(integrator_rk4) * num_seeds);
-  q.memcpy(houti, d_integrators, sizeof(integrator_rk4) * num_seeds).wait();
-  houti += num_seeds;
-
-  // aca se copian elementos desde el incio de
-  // dintg hasta el final en houti,
-
-  // perform integration steps integrate particles
-  // here they use a lambda function to create the parameter to pass to the
-  // for_each thing
-  //
+  if (vtp == output_format::quantized &&
+      (str_backend == "simd" || !queues.empty() ||
+       (str_bricks.length() > 0 && std::stoi(str_bricks) != 0))) {
+    std::cout << "Quantized output is only written by single device runs."
+              << std::endl;
+    return 1;
+  }
 
-  for (int s = 0; s < num_steps - 1;
-       ++s) // se repite para cada paso hasta numero de pasos
-  {
-    std::cerr << "." << std::flush; // flush the cerror stream
+  // the simplified vertices are irregular in time, and collected by the
+  // integration on a single queue
+  if (simplify > 0.0f &&
+      (vtp == output_format::quantized || str_backend == "simd" ||
+       !queues.empty() ||
+       (str_bricks.length() > 0 && std::stoi(str_bricks) != 0))) {
+    std::cout << "Simplification is only done by single device runs, and "
+                 "not with quantized output."
+              << std::endl;
+    return 1;
+  }
 
-    // perform integration steps
+  // instantiate f for the integrator of the requested scheme
+  auto run_scheme = [&](auto f) {
+    if (!dispatch_integrator(str_scheme, dt, tol, f)) {
+      std::cout << "Incorrect or missing argument: integration scheme. "
+                   "Switching to default scheme: rk4."
+                << std::endl;
+      dispatch_integrator("rk4", dt, tol, f);
+    }
+  };
 
-    q.parallel_for(sycl::range<1>(num_seeds),
-                   [&](sycl::id<1> i) { d_integrators[i].step(field, dt); });
-    // whatever comes in i, it must have a step member, and
-    // it's invoked here.
-    // changed here step for Schritt, to try to make the code more legible
-    //
-    q.wait();
+  // instantiate the integration for the requested scheme and field
+  auto run = [&](auto &field) {
+    // the SYCL kernels on the queue, or the SIMD backend on the host
+    run_scheme([&](const auto &seed_state) {
+      if (str_backend == "simd")
+        integrate_host(q, field, seed_state, num_seeds, num_steps, dt, vtp);
+      else
+        integrate(q, field, seed_state, num_seeds, num_steps,
+                  steps_per_launch, compact_interval, sort_interval,
+                  num_buffers, use_cache, dt, vtp, str_stream == "1",
+                  simplify);
+    });
+  };
 
-    q.memcpy(houti, d_integrators, sizeof(integrator_rk4) * num_seeds).wait();
-    // copy back
+  // load the field of type Field, given by a type_tag, with the arguments
+  // args on the default queue or on every queue, and integrate
+  auto load = [&](auto field_type, const auto &...args) {
+    using Field = typename decltype(field_type)::type;
 
-    size_t elements_written = houti - houtput;
+    if (queues.empty()) {
+      Field field(q, args...);
+      run(field);
+      return;
+    }
 
-    // Now iterate only over the last `num_seeds` elements that were just
-    // written
-    // for (size_t i = elements_written - num_seeds; i < elements_written; ++i)
-    // {
-    //   const auto &val = houtput[i];
-    //   std::cout << '(' << val.p.x() << ", " << val.p.y() << ", " << val.p.z()
-    //             << "): " << val.t << std::endl;
-    // }
+    std::deque<Field> fields;
+    for (sycl::queue &device_queue : queues)
+      fields.emplace_back(device_queue, args...);
 
-    houti += num_seeds;
-  }
-  std::cerr << '\n';
+    run_scheme([&](const auto &seed_state) {
+      integrate_devices(queues, fields, seed_state, num_seeds, chunk_size,
+                        num_steps, steps_per_launch, compact_interval,
+                        sort_interval, num_buffers, use_cache, dt, vtp);
+    });
+  };
 
-  // copy back and output
-  if (str_vtp == "1")
-    save_as_vtk(houtput, num_seeds, num_steps, "test.vtp");
+  // load input field: a steady field gives streamlines, a time series gives
+  // pathlines. Steady fields can be stored with 16 bit values and in bricks,
+  // and with --field-cache FILE their encoded voxels are kept in FILE for
+  // the next runs. A cache is reused if the size, the modification time and
+  // 16 sampled blocks of the field file are unchanged, which is not a check
+  // of its whole content: after editing the file in place with its time
+  // kept, rebuild the cache with --refresh-cache 1.
+  if (str_refresh_cache == "1" && !str_field_cache.empty())
+    std::remove(str_field_cache.c_str());
 
-  sycl::free(d_integrators, q);
-  sycl::free(houtput, q);
+  const array_layout layout =
+      str_layout == "brick" ? array_layout::bricked : array_layout::linear;
+
+  // with --bricks N, the field is loaded on demand into a cache of N bricks
+  // of 8x8x8 cells
+  unsigned int num_bricks = 0;
+  if (str_bricks.length() > 0)
+    num_bricks = abs(std::stoi(str_bricks));
+
+  // the stages of a step near a brick boundary sample several bricks, which
+  // must be resident at once: with fewer bricks the integration can stall
+  const unsigned int min_bricks = 16;
+  if (num_bricks > 0 && num_bricks < min_bricks) {
+    std::cout << "A brick cache needs at least " << min_bricks
+              << " bricks. Using " << min_bricks << " instead of "
+              << num_bricks << "." << std::endl;
+    num_bricks = min_bricks;
+  }
+
+  if (num_bricks > 0) {
+    hdf5_brick_field field(q, str_field, num_bricks);
+    run_scheme([&](const auto &seed_state) {
+      integrate_out_of_core(q, field, seed_state, num_seeds, num_steps,
+                            steps_per_launch, dt, vtp);
+    });
+  } else if (str_pathlines == "1")
+    load(type_tag<hdf5_timeseries>(), str_field);
+  else if (str_storage == "half")
+    load(type_tag<hdf5_field<voxel_half3>>(), str_field, layout, 0, -1,
+         str_field_cache);
+  else if (str_storage == "int16")
+    load(type_tag<hdf5_field<voxel_short3>>(), str_field, layout, 0, -1,
+         str_field_cache);
+  else
+    load(type_tag<hdf5_field<voxel_float3>>(), str_field, layout, 0, -1,
+         str_field_cache);
 
   return 0;
 }
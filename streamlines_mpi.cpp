@@ -0,0 +1,412 @@
+#include "devices_sycl.h"
+#include "hdf5_field_sycl.h"
+#include "hdf5_output.h"
+#include "integrators_sycl.h"
+#include "particles_sycl.h"
+
+#include <CL/sycl.hpp>
+#include <mpi.h>
+
+#include "hdf5.h"
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace sycl = cl::sycl;
+
+// -------------------------------------------------------------------------
+// Distributed integration: the grid is split into slabs of z planes, one per
+// MPI rank, and every rank only loads its slab plus one halo plane on each
+// side. Particles are integrated by the rank owning their position and
+// migrate to the owner of their new position after every step. The halo
+// covers all stage samples as long as a step moves a particle by less than
+// one voxel.
+
+// -------------------------------------------------------------------------
+
+/// size and scale of the grid in an HDF5 field file, without reading it
+void read_grid(const std::string &filename, int size[3], float scale[3]) {
+  hid_t file = H5Fopen(filename.c_str(), H5F_ACC_RDONLY, H5P_DEFAULT);
+
+  if (file < 0)
+    throw std::runtime_error("Failed to open HDF5 file");
+
+  hid_t dset = H5Dopen(file, "/field", H5P_DEFAULT);
+  if (dset < 0)
+    throw std::runtime_error("Failed to open HDF5 dataset");
+
+  hid_t space = H5Dget_space(dset);
+  hsize_t dims[4];
+  H5Sget_simple_extent_dims(space, dims, nullptr);
+  H5Sclose(space);
+
+  // the same axes as hdf5_field
+  size[0] = dims[1];
+  size[1] = dims[0];
+  size[2] = dims[2];
+
+  hid_t scale_dset = H5Dopen(file, "/scale", H5P_DEFAULT);
+  H5Dread(scale_dset, H5T_NATIVE_FLOAT, H5S_ALL, H5S_ALL, H5P_DEFAULT, scale);
+
+  H5Dclose(scale_dset);
+  H5Dclose(dset);
+  H5Fclose(file);
+}
+
+// -------------------------------------------------------------------------
+
+/// decomposition of the nz - 1 cells along z into one slab per rank
+struct slab_decomposition {
+  std::vector<int> first; // first cell of every rank, and nz - 1 at the end
+  float scale_z;          // grid z per unit of position
+
+  slab_decomposition(int nz, int num_ranks, float scale_z)
+      : first(num_ranks + 1), scale_z(scale_z) {
+    for (int r = 0; r <= num_ranks; ++r)
+      first[r] = int(int64_t(r) * (nz - 1) / num_ranks);
+  }
+
+  /// the rank owning position p; positions outside the grid belong to the
+  /// first or the last rank, which terminates them
+  int owner(const sycl::float3 &p) const {
+    const float z = p.z() * scale_z;
+    const int num_ranks = first.size() - 1;
+
+    int r = 0;
+    while (r + 1 < num_ranks && z >= first[r + 1])
+      ++r;
+
+    return r;
+  }
+
+  /// the voxel planes [begin, end) loaded by rank r: the corners of its
+  /// cells and one halo plane on each side
+  int planes_begin(int r) const { return std::max(first[r] - 1, 0); }
+  int planes_end(int r) const {
+    return std::min(first[r + 1] + 2, first.back() + 1);
+  }
+};
+
+// -------------------------------------------------------------------------
+
+/// a particle as it migrates between ranks
+template <typename Integrator> struct migrant {
+  Integrator state;
+  unsigned int seed;
+};
+
+/// one point of a trajectory, gathered on rank 0 for the output
+struct trajectory_point {
+  unsigned int seed;
+  unsigned int step;
+  float x, y, z, t;
+};
+
+/// an MPI datatype of the bytes of one T, so that counts and displacements
+/// are in elements rather than bytes; release it with MPI_Type_free
+template <typename T> MPI_Datatype contiguous_type() {
+  MPI_Datatype type;
+  MPI_Type_contiguous(sizeof(T), MPI_BYTE, &type);
+  MPI_Type_commit(&type);
+  return type;
+}
+
+/// n as an MPI count or displacement, which are int
+inline int mpi_count(size_t n) {
+  if (n > size_t(std::numeric_limits<int>::max()))
+    throw std::overflow_error("Too many elements for an MPI count");
+  return static_cast<int>(n);
+}
+
+// -------------------------------------------------------------------------
+
+template <typename Integrator>
+void integrate_mpi(sycl::queue &q, const hdf5_field<voxel_float3> &field,
+                   const slab_decomposition &slabs,
+                   const Integrator &seed_state, unsigned int num_seeds,
+                   unsigned int num_steps, float dt, output_format vtp) {
+  int rank, num_ranks;
+  MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+  MPI_Comm_size(MPI_COMM_WORLD, &num_ranks);
+
+  using particle = migrant<Integrator>;
+
+  // the particles of this rank, on the host for the exchange and on the
+  // device for the integration
+  std::vector<particle> local;
+  std::vector<trajectory_point> points;
+
+  for (unsigned int i = 0; i < num_seeds; ++i) {
+    particle m = {seed_state, i};
+    m.state.p = seed_position(i, num_seeds);
+    m.state.t = 0.0f;
+
+    if (slabs.owner(m.state.p) == rank) {
+      local.push_back(m);
+      points.push_back({i, 0, m.state.p.x(), m.state.p.y(), m.state.p.z(),
+                        m.state.t});
+    }
+  }
+
+  particle *d_particles = sycl::malloc_device<particle>(num_seeds, q);
+  MPI_Datatype particle_type = contiguous_type<particle>();
+
+  std::vector<std::vector<particle>> outgoing(num_ranks);
+  std::vector<int> send_counts(num_ranks), recv_counts(num_ranks);
+  std::vector<int> send_offsets(num_ranks), recv_offsets(num_ranks);
+  std::vector<particle> send_buffer, recv_buffer;
+
+  unsigned long num_migrations = 0;
+  unsigned int num_written = 1;
+
+  MPI_Barrier(MPI_COMM_WORLD);
+  const double start = MPI_Wtime();
+
+  for (unsigned int s = 1; s < num_steps; ++s) {
+    const unsigned int num_local = local.size();
+
+    if (num_local > 0) {
+      q.memcpy(d_particles, local.data(), sizeof(particle) * num_local)
+          .wait();
+
+      q.parallel_for(sycl::range<1>(num_local), [=](sycl::id<1> j) {
+         d_particles[j].state.step(field, dt);
+       }).wait();
+
+      q.memcpy(local.data(), d_particles, sizeof(particle) * num_local)
+          .wait();
+    }
+
+    // record the step, drop terminated particles and sort the others by
+    // the rank owning their new position
+    std::vector<particle> staying;
+    for (auto &out : outgoing)
+      out.clear();
+
+    for (const particle &m : local) {
+      if (std::isnan(m.state.t))
+        continue;
+
+      points.push_back({m.seed, s, m.state.p.x(), m.state.p.y(),
+                        m.state.p.z(), m.state.t});
+
+      const int r = slabs.owner(m.state.p);
+      if (r == rank)
+        staying.push_back(m);
+      else
+        outgoing[r].push_back(m);
+    }
+
+    // exchange the migrating particles
+    send_buffer.clear();
+    for (int r = 0; r < num_ranks; ++r) {
+      send_offsets[r] = mpi_count(send_buffer.size());
+      send_counts[r] = mpi_count(outgoing[r].size());
+      send_buffer.insert(send_buffer.end(), outgoing[r].begin(),
+                         outgoing[r].end());
+    }
+
+    MPI_Alltoall(send_counts.data(), 1, MPI_INT, recv_counts.data(), 1,
+                 MPI_INT, MPI_COMM_WORLD);
+
+    size_t num_received = 0;
+    for (int r = 0; r < num_ranks; ++r) {
+      recv_offsets[r] = mpi_count(num_received);
+      num_received += recv_counts[r];
+    }
+
+    recv_buffer.resize(num_received);
+    MPI_Alltoallv(send_buffer.data(), send_counts.data(), send_offsets.data(),
+                  particle_type, recv_buffer.data(), recv_counts.data(),
+                  recv_offsets.data(), particle_type, MPI_COMM_WORLD);
+
+    num_migrations += send_buffer.size();
+
+    local = std::move(staying);
+    local.insert(local.end(), recv_buffer.begin(), recv_buffer.end());
+
+    // stop once every particle has left the domain
+    unsigned long num_alive = local.size(), total_alive = 0;
+    MPI_Allreduce(&num_alive, &total_alive, 1, MPI_UNSIGNED_LONG, MPI_SUM,
+                  MPI_COMM_WORLD);
+
+    num_written = s + 1;
+
+    if (total_alive == 0)
+      break;
+  }
+
+  const double elapsed = MPI_Wtime() - start;
+
+  double max_elapsed = 0.0;
+  unsigned long total_migrations = 0;
+  MPI_Reduce(&elapsed, &max_elapsed, 1, MPI_DOUBLE, MPI_MAX, 0,
+             MPI_COMM_WORLD);
+  MPI_Reduce(&num_migrations, &total_migrations, 1, MPI_UNSIGNED_LONG,
+             MPI_SUM, 0, MPI_COMM_WORLD);
+
+  if (rank == 0)
+    std::cerr << "integrated " << num_seeds << " seeds over "
+              << num_written - 1 << " steps in " << max_elapsed << " s on "
+              << num_ranks << " ranks (" << total_migrations
+              << " migrations)\n";
+
+  MPI_Type_free(&particle_type);
+  sycl::free(d_particles, q);
+
+  if (vtp == output_format::none)
+    return;
+
+  // gather all trajectory points on rank 0. The displacements are int, so
+  // all points together must not exceed INT_MAX.
+  const int count = mpi_count(points.size());
+  std::vector<int> counts(num_ranks), offsets(num_ranks);
+  MPI_Gather(&count, 1, MPI_INT, counts.data(), 1, MPI_INT, 0,
+             MPI_COMM_WORLD);
+
+  size_t num_points = 0;
+  if (rank == 0)
+    for (int r = 0; r < num_ranks; ++r) {
+      offsets[r] = mpi_count(num_points);
+      num_points += counts[r];
+    }
+
+  std::vector<trajectory_point> all_points(num_points);
+
+  MPI_Datatype point_type = contiguous_type<trajectory_point>();
+  MPI_Gatherv(points.data(), count, point_type, all_points.data(),
+              counts.data(), offsets.data(), point_type, 0, MPI_COMM_WORLD);
+  MPI_Type_free(&point_type);
+
+  if (rank != 0)
+    return;
+
+  // steps without a point end their trajectory
+  std::vector<float> storage(particle_columns::size(num_written, num_seeds),
+                             NAN);
+  const particle_columns houtput = {storage.data(), num_seeds};
+
+  for (const trajectory_point &point : all_points)
+    houtput.store(point.step, point.seed, {point.x, point.y, point.z},
+                  point.t);
+
+  save_trajectories(houtput, num_written, vtp);
+}
+
+// -------------------------------------------------------------------------
+
+int main(int argc, char *argv[]) {
+  MPI_Init(&argc, &argv);
+
+  int rank, num_ranks;
+  MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+  MPI_Comm_size(MPI_COMM_WORLD, &num_ranks);
+
+  // the same parameters as streamlines_man.cpp, where they apply
+  // -----------------------------------------------------------------------
+  std::string curr_arg = "";
+  std::string str_seeds = "";
+  std::string str_steps = "";
+  std::string str_vtp = "";
+  std::string str_dt = "0.002";
+  std::string str_scheme = "";
+  std::string str_tol = "";
+  std::string str_field = "../data/jet_v4.h5";
+  // parse all parameters
+  std::vector<std::string> arguments;
+  arguments.insert(arguments.end(), argv + 1, argv + argc);
+  for (int n = 0; n + 1 < arguments.size(); ++n) {
+    curr_arg = arguments[n];
+    if (curr_arg == "-n" || curr_arg == "--nsteps") {
+      str_steps = arguments[n + 1];
+    }
+    if (curr_arg == "-s" || curr_arg == "--nseeds") {
+      str_seeds = arguments[n + 1];
+    }
+    if (curr_arg == "-v" || curr_arg == "--vtp") {
+      str_vtp = arguments[n + 1];
+    }
+    if (curr_arg == "-t" || curr_arg == "--dt") {
+      str_dt = arguments[n + 1];
+    }
+    if (curr_arg == "--scheme") {
+      str_scheme = arguments[n + 1];
+    }
+    if (curr_arg == "--tol") {
+      str_tol = arguments[n + 1];
+    }
+    if (curr_arg == "-f" || curr_arg == "--field") {
+      str_field = arguments[n + 1];
+    }
+  }
+  // -----------------------------------------------------------------------
+  unsigned int num_seeds = 10000;
+  if (str_seeds.length() > 0 && std::stoi(str_seeds) != 0)
+    num_seeds = abs(std::stoi(str_seeds));
+  unsigned int num_steps = 1000;
+  if (str_steps.length() > 0 && std::stoi(str_steps) != 0)
+    num_steps = abs(std::stoi(str_steps));
+  float dt = std::stof(str_dt);
+  // -v 1, binary or zlib writes test.vtp on rank 0, -v hdf5 test.h5; see
+  // vtk_output.h and hdf5_output.h
+  const output_format vtp = parse_output_format(str_vtp);
+
+  if (vtp == output_format::quantized) {
+    if (rank == 0)
+      std::cout << "Quantized output is only written by single device runs."
+                << std::endl;
+    MPI_Finalize();
+    return 1;
+  }
+
+  float tol = 1e-5f;
+  if (str_tol.length() > 0)
+    tol = std::stof(str_tol);
+
+  // ranks on the same node take different devices, where there are several
+  MPI_Comm node;
+  MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, rank,
+                      MPI_INFO_NULL, &node);
+  int node_rank;
+  MPI_Comm_rank(node, &node_rank);
+  MPI_Comm_free(&node);
+
+  const std::vector<sycl::device> devices = unique_devices();
+  sycl::queue q(devices[node_rank % devices.size()]);
+
+  // every rank loads its slab of the field
+  int size[3];
+  float scale[3];
+  read_grid(str_field, size, scale);
+
+  const slab_decomposition slabs(size[2], num_ranks, scale[2]);
+  hdf5_field<voxel_float3> field(q, str_field, array_layout::linear,
+                                 slabs.planes_begin(rank),
+                                 slabs.planes_end(rank));
+
+  std::cerr << "rank " << rank << ": cells " << slabs.first[rank] << " to "
+            << slabs.first[rank + 1] << " of " << size[2] - 1
+            << " along z, planes " << slabs.planes_begin(rank) << " to "
+            << slabs.planes_end(rank) << " loaded\n";
+
+  auto run_scheme = [&](const auto &seed_state) {
+    integrate_mpi(q, field, slabs, seed_state, num_seeds, num_steps, dt, vtp);
+  };
+
+  if (!dispatch_integrator(str_scheme, dt, tol, run_scheme)) {
+    if (rank == 0)
+      std::cout << "Incorrect or missing argument: integration scheme. "
+                   "Switching to default scheme: rk4."
+                << std::endl;
+    dispatch_integrator("rk4", dt, tol, run_scheme);
+  }
+
+  MPI_Finalize();
+
+  return 0;
+}
@@ -0,0 +1,583 @@
+#ifndef __vtk_output_hpp
+#define __vtk_output_hpp
+
+#include "particles_sycl.h"
+
+#include <zlib.h>
+
+#include <algorithm>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <numeric>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+// -------------------------------------------------------------------------
+
+/// format of the trajectory output. For VTK XML files, ascii writes the
+/// values as text, binary appends them raw to the file and zlib appends
+/// them in compressed blocks, as vtkZLibDataCompressor; hdf5 writes an
+/// HDF5 file instead, and quantized an HDF5 file of 16 bit position codes
+/// of fixed step schemes, see hdf5_output.h. none writes no file.
+enum class output_format { none, ascii, binary, zlib, hdf5, quantized };
+
+/// the format given on the command line: 1 or ascii, binary, zlib, hdf5 or
+/// quantized
+inline output_format parse_output_format(const std::string &name) {
+  if (name == "1" || name == "ascii")
+    return output_format::ascii;
+  if (name == "binary")
+    return output_format::binary;
+  if (name == "zlib")
+    return output_format::zlib;
+  if (name == "hdf5")
+    return output_format::hdf5;
+  if (name == "quantized")
+    return output_format::quantized;
+  return output_format::none;
+}
+
+// -------------------------------------------------------------------------
+
+/// the byte order of the host, in which binary data is written
+inline const char *vtk_byte_order() {
+  const uint16_t probe = 1;
+  return *reinterpret_cast<const uint8_t *>(&probe) == 1 ? "LittleEndian"
+                                                          : "BigEndian";
+}
+
+/// uncompressed size of the blocks of zlib compressed arrays, except for
+/// the last one
+constexpr size_t vtk_block_size = size_t(1) << 20;
+
+/// compress size bytes of data into block, as one block of
+/// vtkZLibDataCompressor
+inline void vtk_compress_block(const void *data, size_t size,
+                               std::vector<char> &block) {
+  uLongf compressed = compressBound(size);
+  block.resize(compressed);
+
+  // the fastest level: positions hardly compress better at higher ones
+  if (compress2(reinterpret_cast<Bytef *>(block.data()), &compressed,
+                static_cast<const Bytef *>(data), size,
+                Z_BEST_SPEED) != Z_OK)
+    throw std::runtime_error("Failed to compress VTK data");
+
+  block.resize(compressed);
+}
+
+// -------------------------------------------------------------------------
+
+/// the appended data section of a VTK XML file, with 64 bit headers
+class vtk_appended_data {
+public:
+  explicit vtk_appended_data(bool compress) : m_compress(compress) {}
+
+  /// append size bytes of data; returns the DataArray element referring
+  /// to them
+  std::string array(const std::string &name, const std::string &type,
+                    int components, const void *data, size_t size) {
+    std::ostringstream element;
+    element << "<DataArray Name=\"" << name << "\" type=\"" << type
+            << "\" NumberOfComponents=\"" << components
+            << "\" format=\"appended\" offset=\"" << m_bytes.size()
+            << "\"/>";
+
+    if (m_compress)
+      append_compressed(static_cast<const char *>(data), size);
+    else {
+      append(uint64_t(size));
+      append(data, size);
+    }
+
+    return element.str();
+  }
+
+  /// the AppendedData element
+  void write(std::ostream &out) const {
+    out << "<AppendedData encoding=\"raw\">_";
+    out.write(m_bytes.data(), m_bytes.size());
+    out << "</AppendedData>";
+  }
+
+private:
+  void append(const void *data, size_t size) {
+    const char *bytes = static_cast<const char *>(data);
+    m_bytes.insert(m_bytes.end(), bytes, bytes + size);
+  }
+
+  void append(uint64_t value) { append(&value, sizeof(value)); }
+
+  /// the header (number of blocks, block size, size of the last block if
+  /// partial, compressed size of every block), then the compressed blocks
+  void append_compressed(const char *data, size_t size) {
+    const size_t num_blocks = (size + vtk_block_size - 1) / vtk_block_size;
+
+    std::vector<uint64_t> header(3 + num_blocks);
+    header[0] = num_blocks;
+    header[1] = vtk_block_size;
+    header[2] = size % vtk_block_size;
+
+    const size_t header_at = m_bytes.size();
+    m_bytes.resize(header_at + header.size() * sizeof(uint64_t));
+
+    std::vector<char> block;
+    for (size_t b = 0; b < num_blocks; ++b) {
+      const size_t first = b * vtk_block_size;
+      vtk_compress_block(data + first, std::min(vtk_block_size, size - first),
+                         block);
+
+      append(block.data(), block.size());
+      header[3 + b] = block.size();
+    }
+
+    std::memcpy(&m_bytes[header_at], header.data(),
+                header.size() * sizeof(uint64_t));
+  }
+
+  bool m_compress;
+  std::vector<char> m_bytes;
+};
+
+// -------------------------------------------------------------------------
+
+/// one data array of a VTK XML file that is produced piece by piece. It is
+/// encoded a block at a time into an unlinked temporary file, and copied
+/// into the appended data of the file once it is complete.
+class vtk_array_stream {
+public:
+  vtk_array_stream(const std::string &path, bool compress)
+      : m_compress(compress) {
+    m_file = std::fopen(path.c_str(), "w+b");
+    if (!m_file)
+      throw std::runtime_error("Failed to create " + path);
+
+    std::remove(path.c_str());
+    m_block.reserve(vtk_block_size);
+  }
+
+  ~vtk_array_stream() { std::fclose(m_file); }
+
+  vtk_array_stream(const vtk_array_stream &) = delete;
+  vtk_array_stream &operator=(const vtk_array_stream &) = delete;
+
+  void append(const void *data, size_t size) {
+    const char *bytes = static_cast<const char *>(data);
+
+    while (size > 0) {
+      const size_t n = std::min(size, vtk_block_size - m_block.size());
+      m_block.insert(m_block.end(), bytes, bytes + n);
+      bytes += n;
+      size -= n;
+
+      if (m_block.size() == vtk_block_size)
+        flush();
+    }
+  }
+
+  /// bytes of the array in the appended data, including its header
+  size_t encoded_size() {
+    flush();
+
+    if (!m_compress)
+      return sizeof(uint64_t) + m_size;
+
+    size_t size = (3 + m_blocks.size()) * sizeof(uint64_t);
+    for (uint64_t block : m_blocks)
+      size += block;
+    return size;
+  }
+
+  /// write the header and the encoded data
+  void copy_to(std::ostream &out) {
+    flush();
+
+    if (m_compress) {
+      std::vector<uint64_t> header = {m_blocks.size(), vtk_block_size,
+                                      m_size % vtk_block_size};
+      header.insert(header.end(), m_blocks.begin(), m_blocks.end());
+      out.write(reinterpret_cast<const char *>(header.data()),
+                header.size() * sizeof(uint64_t));
+    } else {
+      out.write(reinterpret_cast<const char *>(&m_size), sizeof(m_size));
+    }
+
+    std::rewind(m_file);
+
+    std::vector<char> buffer(vtk_block_size);
+    size_t n;
+    while ((n = std::fread(buffer.data(), 1, buffer.size(), m_file)) > 0)
+      out.write(buffer.data(), n);
+  }
+
+private:
+  /// encode the bytes gathered so far
+  void flush() {
+    if (m_block.empty())
+      return;
+
+    m_size += m_block.size();
+
+    if (m_compress) {
+      vtk_compress_block(m_block.data(), m_block.size(), m_compressed);
+      m_blocks.push_back(m_compressed.size());
+      write(m_compressed);
+    } else {
+      write(m_block);
+    }
+
+    m_block.clear();
+  }
+
+  void write(const std::vector<char> &bytes) {
+    if (std::fwrite(bytes.data(), 1, bytes.size(), m_file) != bytes.size())
+      throw std::runtime_error("Failed to write VTK data");
+  }
+
+  bool m_compress;
+  std::FILE *m_file = nullptr;
+  std::vector<char> m_block;      // bytes not encoded yet
+  std::vector<char> m_compressed; // the last compressed block
+  uint64_t m_size = 0;            // bytes encoded so far
+  std::vector<uint64_t> m_blocks; // compressed size of every block
+};
+
+// -------------------------------------------------------------------------
+
+/// write the packed trajectories as the lines of a VTK PolyData file in the
+/// given VTK format. The points are already in the order of the lines, so
+/// the connectivity just counts them.
+inline void save_as_vtk(const packed_trajectories &lines,
+                        const std::string &filename,
+                        output_format format = output_format::ascii) {
+  if (format != output_format::ascii && format != output_format::binary &&
+      format != output_format::zlib)
+    return;
+
+  const unsigned int num_seeds = lines.num_seeds();
+  const size_t num_points = lines.num_points();
+
+  std::vector<int64_t> connectivity(num_points);
+  std::iota(connectivity.begin(), connectivity.end(), int64_t(0));
+
+  // VTK offsets give the end of every line in the connectivity
+  const int64_t *offset = lines.offsets.data() + 1;
+
+  // write to VTP file
+  std::ofstream out(filename, std::ios::binary);
+
+  out << "<?xml version=\"1.0\"?>\n"
+      << "<VTKFile type=\"PolyData\" version=\"1.0\" " << "byte_order=\""
+      << vtk_byte_order() << "\" " << "header_type=\"UInt64\""
+      << (format == output_format::zlib
+              ? " compressor=\"vtkZLibDataCompressor\""
+              : "")
+      << ">" << "<PolyData>" << "<Piece " << "NumberOfPoints=\"" << num_points
+      << "\" " << "NumberOfVerts=\"0\" " << "NumberOfLines=\"" << num_seeds
+      << "\" " << "NumberOfStrips=\"0\" " << "NumberOfPolys=\"0\">";
+
+  if (format == output_format::ascii) {
+    out << "<Points>" << "<DataArray " << "type=\"Float32\" "
+        << "NumberOfComponents=\"3\" " << "format=\"ascii\">\n";
+
+    for (auto c : lines.positions)
+      out << c << ' ';
+
+    out << "</DataArray>" << "</Points>";
+
+    out << "<Lines>" << "<DataArray Name=\"connectivity\" "
+        << "type=\"Int64\" format=\"ascii\">\n";
+
+    for (auto c : connectivity)
+      out << c << '\n';
+
+    out << "</DataArray>" << "<DataArray Name=\"offsets\" "
+        << "type=\"Int64\" format=\"ascii\">\n";
+
+    for (unsigned int i = 0; i < num_seeds; ++i)
+      out << offset[i] << '\n';
+
+    out << "</DataArray>" << "</Lines>" << "<PointData Scalars=\"time\">"
+        << "<DataArray Name=\"time\" type=\"Float32\" format=\"ascii\">\n";
+
+    for (auto t : lines.times)
+      out << t << '\n';
+
+    out << "\n</DataArray>" << "</PointData>" << "</Piece>" << "</PolyData>"
+        << "</VTKFile>" << '\n';
+  } else {
+    vtk_appended_data appended(format == output_format::zlib);
+
+    out << "<Points>"
+        << appended.array("Points", "Float32", 3, lines.positions.data(),
+                          lines.positions.size() * sizeof(float))
+        << "</Points>" << "<Lines>"
+        << appended.array("connectivity", "Int64", 1, connectivity.data(),
+                          connectivity.size() * sizeof(int64_t))
+        << appended.array("offsets", "Int64", 1, offset,
+                          num_seeds * sizeof(int64_t))
+        << "</Lines>" << "<PointData Scalars=\"time\">"
+        << appended.array("time", "Float32", 1, lines.times.data(),
+                          lines.times.size() * sizeof(float))
+        << "</PointData>" << "</Piece>" << "</PolyData>";
+
+    appended.write(out);
+
+    out << "</VTKFile>" << '\n';
+  }
+
+  std::cerr << "wrote " << num_seeds << " streamlines (" << num_points
+            << " points) to " << filename << '\n';
+}
+
+// -------------------------------------------------------------------------
+
+/// trajectory output that writes a VTP file while the particles are
+/// integrated, with the interface of host_trajectories. Batches of steps
+/// are copied into a bounded pool of pinned host buffers and handed to a
+/// writer thread, which appends them to the file, so that host memory does
+/// not grow with the number of steps and writing overlaps integration.
+/// Every step stores a point per seed in the order the steps arrive; seeds
+/// that terminated repeat their last point, which no line refers to.
+class vtp_stream {
+public:
+  /// batches have at most max_steps steps; format is binary or zlib
+  vtp_stream(sycl::queue &q, const std::string &filename,
+             unsigned int num_seeds, unsigned int max_steps,
+             output_format format, unsigned int num_buffers = 4)
+      : m_q(q), m_filename(filename), m_num_seeds(num_seeds),
+        m_compress(format == output_format::zlib),
+        m_points(filename + ".points", m_compress),
+        m_times(filename + ".times", m_compress), m_length(num_seeds, 0),
+        m_last(size_t(num_seeds) * 4, float(NAN)) {
+    for (unsigned int n = 0; n < num_buffers; ++n)
+      m_free.push_back(sycl::malloc_host<float>(
+          particle_columns::size(max_steps, num_seeds), q));
+
+    m_writer = std::thread([this]() { run(); });
+  }
+
+  ~vtp_stream() {
+    if (m_writer.joinable())
+      close();
+
+    for (float *buffer : m_free)
+      sycl::free(buffer, m_q);
+  }
+
+  vtp_stream(const vtp_stream &) = delete;
+  vtp_stream &operator=(const vtp_stream &) = delete;
+
+  unsigned int num_seeds() const { return m_num_seeds; }
+
+  /// copy the steps [step, step + num_steps) from the device columns
+  /// trajectory once computed is complete, and queue them for writing;
+  /// waits while all buffers are queued. See host_trajectories::copy().
+  sycl::event copy(sycl::queue &q, const particle_columns &trajectory,
+                   unsigned int, unsigned int num_steps,
+                   sycl::event computed) {
+    const particle_columns batch = reserve();
+
+    sycl::event copied = q.submit([&](sycl::handler &h) {
+      h.depends_on(computed);
+      h.memcpy(batch.data, trajectory.data,
+               sizeof(float) * particle_columns::size(num_steps, m_num_seeds));
+    });
+
+    commit(batch, num_steps, copied);
+    return copied;
+  }
+
+  /// write the remaining steps and complete the file
+  void finish() {
+    close();
+
+    if (m_error)
+      std::rethrow_exception(m_error);
+
+    // the lines refer to the points of their seed up to its last step
+    vtk_array_stream connectivity(m_filename + ".connectivity", m_compress);
+    vtk_array_stream offsets(m_filename + ".offsets", m_compress);
+
+    int64_t end = 0;
+    for (unsigned int i = 0; i < m_num_seeds; ++i) {
+      for (unsigned int k = 0; k < m_length[i]; ++k) {
+        const int64_t point = int64_t(k) * m_num_seeds + i;
+        connectivity.append(&point, sizeof(point));
+      }
+
+      end += m_length[i];
+      offsets.append(&end, sizeof(end));
+    }
+
+    const uint64_t num_points = uint64_t(m_num_steps) * m_num_seeds;
+
+    std::ofstream out(m_filename, std::ios::binary);
+
+    size_t offset = 0;
+    auto array = [&](const char *name, const char *type, int components,
+                     vtk_array_stream &data) {
+      out << "<DataArray Name=\"" << name << "\" type=\"" << type
+          << "\" NumberOfComponents=\"" << components
+          << "\" format=\"appended\" offset=\"" << offset << "\"/>";
+      offset += data.encoded_size();
+    };
+
+    out << "<?xml version=\"1.0\"?>\n"
+        << "<VTKFile type=\"PolyData\" version=\"1.0\" " << "byte_order=\""
+        << vtk_byte_order() << "\" header_type=\"UInt64\""
+        << (m_compress ? " compressor=\"vtkZLibDataCompressor\"" : "") << ">"
+        << "<PolyData>" << "<Piece NumberOfPoints=\"" << num_points
+        << "\" NumberOfVerts=\"0\" NumberOfLines=\"" << m_num_seeds
+        << "\" NumberOfStrips=\"0\" NumberOfPolys=\"0\">" << "<Points>";
+    array("Points", "Float32", 3, m_points);
+    out << "</Points>" << "<Lines>";
+    array("connectivity", "Int64", 1, connectivity);
+    array("offsets", "Int64", 1, offsets);
+    out << "</Lines>" << "<PointData Scalars=\"time\">";
+    array("time", "Float32", 1, m_times);
+    out << "</PointData>" << "</Piece>" << "</PolyData>"
+        << "<AppendedData encoding=\"raw\">_";
+
+    m_points.copy_to(out);
+    connectivity.copy_to(out);
+    offsets.copy_to(out);
+    m_times.copy_to(out);
+
+    out << "</AppendedData>" << "</VTKFile>" << '\n';
+
+    std::cerr << "wrote " << m_num_seeds << " streamlines (" << end
+              << " points) to " << m_filename << '\n';
+  }
+
+private:
+  struct pending {
+    particle_columns batch;
+    unsigned int num_steps;
+    sycl::event copied;
+  };
+
+  /// a free host buffer; waits while all buffers are queued for writing
+  particle_columns reserve() {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_changed.wait(lock, [this]() { return !m_free.empty() || m_error; });
+
+    if (m_error)
+      std::rethrow_exception(m_error);
+
+    float *buffer = m_free.back();
+    m_free.pop_back();
+
+    return {buffer, m_num_seeds};
+  }
+
+  /// queue the steps of batch for writing once the event copied is done
+  void commit(const particle_columns &batch, unsigned int num_steps,
+              sycl::event copied) {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_queue.push_back({batch, num_steps, copied});
+    }
+    m_changed.notify_all();
+  }
+
+  /// stop the writer thread once the queue is empty
+  void close() {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_closing = true;
+    }
+    m_changed.notify_all();
+    m_writer.join();
+  }
+
+  /// the writer thread
+  void run() {
+    std::vector<float> points(size_t(m_num_seeds) * 3);
+    std::vector<float> times(m_num_seeds);
+
+    for (;;) {
+      pending next;
+      {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_changed.wait(lock,
+                       [this]() { return !m_queue.empty() || m_closing; });
+
+        if (m_queue.empty())
+          return;
+
+        next = m_queue.front();
+        m_queue.pop_front();
+      }
+
+      next.copied.wait();
+
+      try {
+        for (unsigned int k = 0; k < next.num_steps; ++k, ++m_num_steps) {
+          for (unsigned int i = 0; i < m_num_seeds; ++i) {
+            float *last = &m_last[size_t(i) * 4];
+            const float t = next.batch.time(k, i);
+
+            // a trajectory ends at its first NaN time
+            if (m_length[i] == m_num_steps && !std::isnan(t)) {
+              last[0] = next.batch.column(k, 0)[i];
+              last[1] = next.batch.column(k, 1)[i];
+              last[2] = next.batch.column(k, 2)[i];
+              last[3] = t;
+              ++m_length[i];
+            }
+
+            points[i * 3 + 0] = last[0];
+            points[i * 3 + 1] = last[1];
+            points[i * 3 + 2] = last[2];
+            times[i] = last[3];
+          }
+
+          m_points.append(points.data(), points.size() * sizeof(float));
+          m_times.append(times.data(), times.size() * sizeof(float));
+        }
+      } catch (...) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_error = std::current_exception();
+      }
+
+      {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_free.push_back(next.batch.data);
+      }
+      m_changed.notify_all();
+    }
+  }
+
+  sycl::queue &m_q;
+  std::string m_filename;
+  unsigned int m_num_seeds;
+  bool m_compress;
+
+  // owned by the writer thread until it is closed
+  vtk_array_stream m_points, m_times;
+  std::vector<unsigned int> m_length; // points of the trajectory of a seed
+  std::vector<float> m_last;          // its last point and time
+  unsigned int m_num_steps = 0;       // steps written
+
+  std::mutex m_mutex;
+  std::condition_variable m_changed;
+  std::vector<float *> m_free; // buffers not queued
+  std::deque<pending> m_queue;
+  bool m_closing = false;
+  std::exception_ptr m_error;
+  std::thread m_writer;
+};
+
+#endif // __vtk_output_hpp